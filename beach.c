@@ -6,17 +6,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <semaphore.h>
 
 typedef int16_t i16;
+typedef int32_t i32;
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
@@ -24,90 +35,602 @@ typedef uint64_t u64;
 #define serverMain main
 #elif defined(CLIENT)
 #define clientMain main
+#elif defined(BENCH)
+#define benchMain main
+#elif defined(CTL)
+#define ctlMain main
 #endif
 
 char *configfile = "./config";
-char *savefile = "./data";
-char *tempfile = "./.temp";
+//the files of a season are kept in its directory, the main beach uses the current one
+char *beachDir = "./beaches";
+char *savefile = "data";
+char *tempfile = ".temp";
+char *walfile = "wal";
+char *snapfile = "snapshot";
+char *deltafile = "snapshot.delta";
 char *logFile = "./log";
 FILE *logStream;
-pthread_mutex_t logMutex;
 
 char *commands = "\nLista Comandi:\n"
                  "login id\n"
                  "book\n"
-                 "  book id\n"
+                 "  book id [[start] end]\n"
                  "    book id [start] [end]\n"
                  "    cancel\n"
+                 "bookgroup id,id,... [start] end\n"
+                 "findrow row n [start] [end]\n"
                  "available [start] [end]\n"
                  "availrow row [start] [end]\n"
                  "cancel id\n"
+                 "cancel all\n"
+                 "mybookings\n"
                  "today\n"
                  "start\n"
                  "end\n"
                  "save\n"
+                 "export\n"
+                 "binary\n"
+                 "stats\n"
+                 "watch [row] [start] [end]\n"
+                 "unwatch\n"
+                 "use beach\n"
+                 "beaches\n"
+                 "load beach\n"
+                 "unload beach\n"
+                 "bulk\n"
+                 "  id user start end\n"
+                 "  commit\n"
                  "logout\n\n";
 
-#define MAX_CONN 10
+#define MAX_CONN 10   //default of maxconn
+#define CONN_CHUNK 64 //connections allocated together as the table grows
+#define MAX_TOKS 10
+#define IN_SIZE 4096 //receive ring, also the longest command accepted
+#define OUT_SIZE 4096   //first size of the reply buffer, bigger ones are dropped on reuse
+#define OUT_FLUSH 65536 //replies written mid batch once this much is waiting
+#define MAX_GROUP 64 //umbrellas of a group booking
+#define BULK_BATCH 4096 //rows of a bulk load checked and booked together
+#define BULK_REPORT 100 //rejected rows listed in the reply to commit
+#define MAX_EVENTS 64
+#define CACHE_LINE 64
+#define IDLE_TIMEOUT 60
+#define WHEEL_SLOTS 64 //seconds covered by the idle timer wheel, more than IDLE_TIMEOUT
+
+//dialogue state of a connection, replaces the nested blocking reads
+enum {
+  CONN_LOGIN,       //waiting for "login id"
+  CONN_READY,       //waiting for a command
+  CONN_BOOK,        //"book" received, waiting for "book id"
+  CONN_BOOK_DATES,  //umbrella locked, waiting for "book id dates" or "cancel"
+  CONN_BULK         //"bulk" received, taking rows until "commit"
+};
+
+//replies waiting to be sent, the buffer stays with the slot across connections
+typedef struct Output {
+  char *buf;
+  u32 len;  //bytes queued
+  u32 sent; //bytes of them already written
+  u32 size;
+} Output;
+
+//binary protocol, switched on by the "binary" command: fixed size little endian
+//requests, replies made of a header and a payload
+enum { BIN_LOGIN = 1, BIN_AVAILABLE, BIN_AVAILROW, BIN_BOOK, BIN_CANCEL, BIN_LOGOUT };
+enum { BIN_OK, BIN_NAVAILABLE, BIN_FAILED };
+
+typedef struct BinRequest {
+  u8 op;
+  u8 pad;
+  u16 row;        //BIN_AVAILROW
+  u32 arg;        //user for BIN_LOGIN, umbrella for BIN_BOOK and BIN_CANCEL
+  i16 start, end; //days of the year, -1 is today
+} BinRequest;
+
+//availability payload: u32 id of the first bit, u32 number of free umbrellas,
+//then the words of the bitset of the free umbrellas
+typedef struct BinReply {
+  u8 op;
+  u8 status;
+  u16 pad;
+  u32 len; //payload bytes following the header
+} BinReply;
+
+//subscription of the watch command, the bitsets have a bit per umbrella of the beach;
+//the worker owns it while the connection is busy, the reactor otherwise
+typedef struct Watch {
+  struct Season *season;
+  u32 first, last; //umbrellas watched
+  int start, end;  //days they must be free
+  int active;      //cleared by unwatch, the reactor frees it when it gets it back
+  int missed;      //changes came while busy, every umbrella is looked at again
+  u32 words;
+  u64 *free;       //state last sent
+  u64 *dirty;      //umbrellas changed since then
+  struct WatchGroup *group; //watchers of the reactor it is linked in
+  struct Connection *prev, *next;
+} Watch;
+
+//watchers of a season on a reactor
+typedef struct WatchGroup {
+  struct Season *season;
+  struct Connection *head;
+  u64 *batch; //umbrellas changed, taken from the season at each pass
+} WatchGroup;
+
+enum { BULK_ADDED, BULK_PRESENT, BULK_REJECTED };
+
+//a booking of a bulk load, line numbers the rows in the input for the report
+typedef struct BulkRow {
+  u32 umbrella, user;
+  i16 start, end;
+  u32 line;
+  int status;
+} BulkRow;
+
+//rows of the bulk command not booked yet and the tally so far
+typedef struct Bulk {
+  BulkRow row[BULK_BATCH];
+  int n;
+  u32 line;
+  u32 added, present, rejected;
+  u32 report[BULK_REPORT]; //first rejected rows
+} Bulk;
 
 typedef struct Connection {
   int id;
   int csd;
-  int prev;
-  int next;
+  int nextFree; //next slot of the free list, -1 at its end
+  u8 open;
+  int reactor;
+  int state;
+  int busy;
+  int closing;
+  u32 user;
+  u32 umbrella;
+  time_t lastActive;
+  int nToks;
+  char *toks[MAX_TOKS];
+  u8 binary;    //speaking the binary protocol
+  u8 eof;       //the peer closed, the buffered commands are still executed
+  u8 discard;   //dropping a command longer than the ring up to its terminator
+  u32 inHead, inTail;
+  char in[IN_SIZE];
+  Output out;
+  struct Connection *nextJob;
+  struct Connection *timerPrev, *timerNext; //idle timer wheel of the reactor
+  int timerSlot; //-1 until the reactor takes the connection in
+  struct ConnectionList *list; //shard of the listener that accepted it
+  struct Season *season; //beach chosen with use, a reference is held while open
+  Watch *watch;
+  Bulk *bulk;
 } Connection;
 
+//the slots never move, the table grows by chunks up to max
 typedef struct ConnectionList {
-  Connection *conn;
+  Connection **chunk;
+  u32 nChunks;
   u32 count;
   u32 max;
-  int closed;
-  int open;
+  u64 freeHead; //id + 1 of the first free slot, a tag against ABA in the high half
+  int closed;   //set on shutdown, no more connections are accepted
   int msd;
-  pthread_mutex_t mutex;
+  pthread_t listener;
+  pthread_mutex_t mutex; //held while growing
 } ConnectionList;
 
+//fifo of connections with a parsed command waiting to be handled
+typedef struct JobQueue {
+  Connection *head, *tail;
+  int stop; //the waiting workers return NULL once it is empty
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} JobQueue;
+
+//event loop owning a set of sockets
+typedef struct Reactor {
+  int id;
+  int epfd;
+  int wakefd;
+  JobQueue done; //connections handed back by the workers and the new ones
+  Connection *wheel[WHEEL_SLOTS]; //connections by the second of their idle deadline
+  time_t wheelTime; //last second expired
+  WatchGroup *watch; //watchers by season, the empty groups are reused
+  int nWatch;
+  int notify;        //some watched umbrella changed since the last pass
+  int stop;          //set on shutdown, the loop returns at its next wakeup
+  pthread_t thread;
+} Reactor;
+
+typedef struct Server {
+  int nReactors;
+  int metricsPort; //local port of the prometheus text dump, 0 disables it
+  int maxConn;
+  int port;
+  int nListeners; //accepting threads, each with its own socket and connection shard
+  Reactor *reactor;
+  char *beaches; //comma separated beaches loaded at startup
+  int replPort;    //local port streaming the changes to the replicas, 0 disables it
+  int primaryPort; //replication port of the primary, set only on the read-only replicas
+  int maxLag;      //seconds without news from the primary before a replica refuses queries
+} Server;
+
 typedef struct String {
   char *str;
   size_t size;
   size_t len;
 } String;
 
+//log-linear histogram: values below HIST_SUB are exact, above every power of two
+//is split in HIST_SUB buckets
+#define HIST_SUB 16
+#define HIST_BUCKETS (61 * HIST_SUB)
+typedef struct Histogram {
+  u64 count;
+  u64 sum;
+  u64 max;
+  u64 bucket[HIST_BUCKETS];
+} Histogram;
+
+//commands counted by the statistics, the text ones are looked up by name
+enum {
+  CMD_LOGIN, CMD_BOOK_ID, CMD_BOOK_DATES,
+  CMD_BOOK, CMD_BOOKGROUP, CMD_FINDROW, CMD_AVAILABLE, CMD_AVAILROW, CMD_CANCEL,
+  CMD_LOGOUT, CMD_SAVE, CMD_EXPORT, CMD_TODAY, CMD_START, CMD_END, CMD_HELP,
+  CMD_BINARY, CMD_STATS, CMD_MYBOOKINGS, CMD_USE, CMD_BEACHES, CMD_LOAD, CMD_UNLOAD,
+  CMD_WATCH, CMD_UNWATCH, CMD_BULK, CMD_BULK_ROW, CMD_UNKNOWN,
+  CMD_BIN_LOGIN, CMD_BIN_AVAILABLE, CMD_BIN_AVAILROW, CMD_BIN_BOOK, CMD_BIN_CANCEL,
+  CMD_BIN_LOGOUT, CMD_BIN_UNKNOWN,
+  N_CMDS
+};
+enum { LOCK_BOOKING, LOCK_CONNS, LOCK_LEASE, N_LOCKS };
+
+//statistics of a thread, written only by their thread and merged when read
+typedef struct Stats {
+  Histogram latency[N_CMDS]; //microseconds spent executing the commands
+  Histogram lockWait[N_LOCKS]; //microseconds waited on contended mutexes
+  u64 bytesIn, bytesOut;
+  struct Stats *next;
+} Stats;
+
 typedef struct Booking {
   i16 start, end;
   u32 user;
 } Booking;
 
+//the booking arrays of a season come from slabs of 1, 2, 4... bookings carved in turn
+//out of big chunks, so the lists loaded together lie next to each other in umbrella order
+#define SLAB_CLASSES 13          //up to 4096 bookings, the longer arrays are malloc'd
+#define SLAB_CHUNK (64 * 1024)
+
+typedef struct SlabClass {
+  void *free;         //released blocks, linked through their first bytes
+  char *next, *limit; //part of the chunk not carved yet
+  pthread_mutex_t mutex;
+} SlabClass;
+
+typedef struct Arena {
+  SlabClass slab[SLAB_CLASSES];
+  char **chunk;
+  u32 nChunks;
+  pthread_mutex_t mutex; //chunk table
+  u64 used;     //bytes of the arrays handed out
+  u64 reserved; //bytes of the chunks and of the malloc'd arrays
+} Arena;
+
+//what only the holder of the list lock reads, the fields scanned without it are
+//kept in the arrays of the season
 typedef struct BookingList {
   Booking *booking;
   u32 count;
   u32 capacity;
-  u32 lockUser;
-  i16 lockDay;
-  pthread_mutex_t mutex;
+  u64 lsn;     //last log record applied to the list
 } BookingList;
 
+//a line each, the writers of neighbouring umbrellas do not share them
+typedef struct ListLock {
+  pthread_mutex_t mutex;
+} __attribute__((aligned(CACHE_LINE))) ListLock;
+
+//the bookings of every user, kept by insertBooking and deleteBooking
+#define USER_STRIPES 64
+
+typedef struct UserBooking {
+  u32 umbrella;
+  i16 start, end;
+} UserBooking;
+
+typedef struct UserEntry {
+  u32 user;
+  u32 count, capacity; //capacity 0 marks a free slot
+  UserBooking *booking;
+} UserEntry;
+
+//open addressing table of the users hashed to the stripe, locked after the lists
+typedef struct UserStripe {
+  UserEntry *entry;
+  u32 size, used;
+  pthread_mutex_t mutex;
+} UserStripe;
+
+//WAL_GROUP precedes the records of a group booking, replayed only if all present,
+//WAL_LOCK is only found in the logs of older versions and skipped
+enum { WAL_ADD = 1, WAL_REMOVE, WAL_LOCK, WAL_GROUP };
+
+//record of the append-only write-ahead log
+typedef struct WalRecord {
+  u64 lsn;
+  u32 umbrella;
+  u32 user;
+  i16 start, end; //WAL_GROUP keeps the size in user
+  u8 type;
+  u8 pad[3];
+} WalRecord;
+
+//the log is split in segments wal.1, wal.2, ... rotated at every checkpoint
+#define WAL_BASE 256
+#define WAL_PATH (WAL_BASE + 11) //a base, its dot and the longest segment number
+typedef struct Wal {
+  int fd;
+  u32 seq;        //segment being written
+  u32 firstSeq;   //oldest segment not covered by the snapshot
+  u64 nextLsn;
+  u64 durableLsn; //records below this are on disk
+  int rotate;
+  int stop;
+  int replicate;  //durable batches are also queued for the replicas
+  char base[WAL_BASE]; //path of the segments without their number
+  String pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t flushCond;
+  pthread_cond_t syncCond;
+  pthread_t thread;
+} Wal;
+
+//records of the replication stream besides the log ones: a list sent whole to a new
+//replica, one of its bookings, the end of the copy and the keepalive of an idle primary
+enum { REPL_LIST = 16, REPL_BOOKING, REPL_READY, REPL_HEARTBEAT };
+
+#define REPL_BACKLOG (16 << 20) //bytes queued for a replica before dropping it, it resyncs
+#define REPL_KEEPALIVE 1        //seconds between the keepalives of an idle stream
+
+//a replica connected to the primary, fed by its own thread
+typedef struct Follower {
+  int fd;
+  int dead;
+  String out; //records waiting to be sent
+  pthread_cond_t cond;
+  struct Follower *next;
+} Follower;
+
+typedef struct Replication {
+  Follower *followers; //on the primary
+  int nFollowers;
+  pthread_mutex_t mutex;
+  time_t contact;      //on a replica, last record or keepalive received
+  u64 lsn;             //on a replica, last change applied
+  int synced;          //on a replica, the copy of the lists is complete
+} Replication;
+
+//one bit per day of the year, set when the umbrella is booked
+#define SEASON_DAYS 366
+#define DAY_WORDS ((SEASON_DAYS + 63) / 64)
+typedef u64 DayMap[DAY_WORDS];
+
+//number of words of a bitset with one bit per umbrella
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+
+//free set of a day, bit per umbrella
+typedef struct DaySet {
+  int day;       //-1 while built
+  u64 free[];
+} DaySet;
+
+//answer of available with no dates, read lock-free like the lists: seq is odd while rewritten
+typedef struct DayReply {
+  u32 seq;
+  int day;
+  u64 gen;       //of the free set it was built from
+  u32 len;
+  char *text;
+} DayReply;
+
+//free set of today, kept by the changes and moved by the clock thread at midnight
+typedef struct DayCache {
+  DaySet *set;   //published whole with its day
+  DaySet *next;  //being built by the rollover for nextDay, the changes go in both
+  int nextDay;
+  DaySet *spare; //the one replaced by the last rollover, reused by the next
+  u64 gen;       //changes of the set so far
+  DayReply reply[2]; //current is the last built, the other one is rewritten
+  DayReply *current;
+  pthread_mutex_t mutex; //held while rolling over or rebuilding the reply
+} DayCache;
+
+#define LEASE_TIME 30  //default seconds a reservation of "book id" is held
+#define LEASE_SLOTS 64 //seconds covered by the lease wheel, more than any lease
+
+//days of an umbrella reserved to a user while the booking is completed, not saved
+typedef struct Lease {
+  u32 user;
+  u32 umbrella;
+  i16 start, end;
+  time_t expires;
+  struct Lease *next; //leases of the same umbrella
+  struct Lease *timerPrev, *timerNext;
+} Lease;
+
+//every slot of the wheel holds the leases expiring in a single second
+typedef struct Leases {
+  Lease **umbrella;
+  Lease *wheel[LEASE_SLOTS];
+  time_t wheelTime; //last second expired
+  pthread_mutex_t mutex;
+} Leases;
+
 typedef struct Season {
   int nRows, nCols;
   int nUmbrella;
   int year;
   int start, end;
   BookingList *bookingList;
+  ListLock *lock;
+  u32 *version; //seqlock of each list, odd while a writer is changing it
+  DayMap *days; //occupancy index, read with the versions
+  u64 *byDay;   //umbrellas booked on each day of the season, dayWords per day
+  u32 dayWords;
+  u8 *dirty;    //lists changed since the last checkpoint
+  UserStripe *users; //per-user index, NULL until the lists are loaded
+  Wal wal;
+  pthread_mutex_t checkpointMutex;
+  void *snap; //mapping of the snapshot, lists are copied out on first write
+  size_t snapSize;
+  int checkpointInterval; //seconds between incremental checkpoints, 0 disables them
+  int checkpointRate;     //KB/s written by the incremental checkpoints, 0 is unbounded
+  int leaseTime;          //seconds a reservation is held, less than LEASE_SLOTS
+  pthread_t checkpointThread;
+  char name[32];
+  char dir[160]; //directory of its config and files
+  int refs;      //held by the registry and by the connections using it
+  int unloaded;  //out of the registry lookups, closed when the last reference goes
+  int stop;      //asks the checkpoint thread to return
+  int readOnly;  //mirror of the primary on a replica, no files and no writes
+  int nWorkers;
+  pthread_t *workers;
+  JobQueue jobs; //commands of its connections, run only by its own workers
+  int watchers;  //active watch subscriptions, nothing is tracked without them
+  u64 *changed;  //umbrellas changed since the last pass of each reactor, a bitset each
+  DayCache today;
+  Leases leases;
+  Arena arena; //booking arrays
+  int lockFd;  //config file, locked against a second process using the same files
 } Season;
 
-Season *season;
-ConnectionList *conns;
+//loaded seasons by beach name, the first one is the beach of ./config
+typedef struct Beaches {
+  Season **season;
+  int count;
+  char **loading; //names reserved by the loads in progress
+  int nLoading;
+  pthread_mutex_t mutex;
+} Beaches;
+
+#define SNAP_MAGIC 0x504e534843414542ULL //"BEACHSNP"
+#define SNAP_VERSION 1
+
+//binary snapshot: header, one SnapEntry and one DayMap per umbrella, then the bookings
+typedef struct SnapHeader {
+  u64 magic;
+  u32 version;
+  u32 walSeq;
+  i32 nRows, nCols;
+  i32 year;
+  i32 start, end;
+  u32 nUmbrella;
+  u64 nBooking;
+} SnapHeader;
+
+typedef struct SnapEntry {
+  u64 offset; //index of the first booking
+  u64 lsn;
+  u32 count;
+  u32 pad;
+} SnapEntry;
+
+#define DELTA_COMMIT 0xffffffff
 
-//prints formatted text to the logfile
+//incremental checkpoint: the state of every dirty umbrella followed by its bookings,
+//closed by an entry with umbrella DELTA_COMMIT and the first log segment in count
+typedef struct DeltaEntry {
+  u32 umbrella;
+  u32 count;
+  u64 lsn;
+} DeltaEntry;
+
+//log records are a LogRecord header followed by the text, padded to 8 bytes
+#define LOG_RING (64 * 1024)
+#define LOG_LINE 1024
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+typedef struct LogRecord {
+  u32 len;
+  u32 level;
+} LogRecord;
+
+//single producer single consumer ring, written by its thread and drained by the writer
+typedef struct LogRing {
+  u64 head; //advanced by the producer
+  u64 tail; //advanced by the writer
+  u64 dropped;
+  struct LogRing *next;
+  char buf[LOG_RING];
+} LogRing;
+
+typedef struct Logger {
+  int level; //records below it are not formatted at all
+  int block; //a full ring makes the producer wait instead of dropping the record
+  u64 maxSize; //bytes before the file is rotated to log.1, 0 never rotates
+  u64 size;
+  int running;
+  LogRing *rings;
+  pthread_mutex_t mutex; //held while registering rings and while draining
+  pthread_t thread;
+} Logger;
+
+Beaches beaches = {NULL, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+Replication repl = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+ConnectionList *conns; //one shard per listener
+Server *server;
+Logger logger = {LOG_INFO, 0, 0, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER};
+
+//queues a formatted line for the logfile, never waits for the disk
+void logPrint(int level, const char *format, ...);
+//prints formatted text to the logfile at the info level
 void mprintf(const char *format, ...);
+//writes everything queued so far, used before exiting
+void logFlush();
+//starts the thread writing the rings to the logfile
+void startLogger();
 
 //cancats fomatted text to a String and grows it if it doesn't fit
 int dcatf(String *string, const char *format, ...);
 
+void histRecord(Histogram *hist, u64 value);
+void histMerge(Histogram *to, Histogram *from);
+//returns the lower bound of the bucket holding the p-th percentile
+u64 histPercentile(Histogram *hist, double p);
+//returns microseconds from an arbitrary point
+u64 nowUsec();
+
+//statistics of the calling thread, registered on first use
+Stats *threadStats();
+//locks the mutex, timing the wait when it is contended
+void statLock(pthread_mutex_t *mutex, int lock);
+//merges the statistics of all the threads
+void mergeStats(Stats *total);
+//statistics entry of a text command, from the connection state before executing it
+int commandIndex(Connection *conn, int state);
+//dumps the statistics as text for the stats command or in the prometheus format
+void statsText(String *out, int prometheus);
+//thread serving the prometheus dump on the local metrics port
+void *metricsLoop(void *arg);
+//thread accepting the replicas on the local replication port of the primary
+void *replicationLoop(void *arg);
+//thread of a replica following the primary, reconnects when the stream breaks
+void *replicaLoop(void *arg);
+//queues a durable batch of log records for every replica
+void replicate(const char *data, size_t len);
+//ends the watch subscription of the connection, if any
+void stopWatch(Connection *conn);
+//sends the pending changes of the watch subscription of the connection
+void sendWatch(Connection *conn);
+
 //convert year, month, day to an integer (1-365)
 int getYday(int currentYear, int year, int mon, int mday);
-//returns yday for the current day
+//returns yday for the current day, kept by the clock thread once it runs
 int getCurrentYday();
+//thread moving the current day and the caches of today at midnight
+void *clockLoop(void *arg);
 //convert date formatted like dd/mm/yyyy into yday
 int parseDate(char *str, int currentYear);
 //convert date formatted like dd/mm/yyyy into the corresponding year
@@ -115,65 +638,346 @@ int parseYear(char *str);
 //convert yday into a string formatted like dd/mm/yyyy
 int getDateString(char *out, size_t len, int year, int yday);
 
-void loadConfig(Season *season);
+//the main config also sets the server, the ones of the other beaches only their season
+//returns -1 if the file is missing or invalid
+int loadConfig(Season *season, Server *server, const char *path);
 void initBookingList(Season *season);
+//checkpoint: rotates the log, writes the snapshot and drops the covered segments
 void saveBookingList(Season *season);
+//loads the snapshot (or imports the text file) and replays the log tail
 void loadBookingList(Season *season);
+//same, leaving the files alone: returns the last segment of the log it read
+u32 readBookingList(Season *season, u32 *walSeq, u64 *lastLsn);
+//text format, kept for import and export
+void importBookingList(Season *season, const char *path, u32 *walSeq, u64 *lastLsn);
+void exportBookingList(Season *season, const char *path);
+//returns -1 if there is no snapshot
+int loadSnapshot(Season *season, u32 *walSeq, u64 *lastLsn);
+int writeSnapshot(Season *season, const char *path, u32 walSeq);
+//appends the umbrellas changed since the last checkpoint to the delta file
+void deltaCheckpoint(Season *season);
+void loadDelta(Season *season, u32 *walSeq, u64 *lastLsn);
+//thread running the incremental checkpoints
+void *checkpointLoop(void *season);
+
+//starts the log writer on a new segment
+void initWal(Wal *wal, u32 seq, u64 nextLsn);
+//queues a record, to be called with the umbrella mutex held, returns its lsn
+u64 walAppend(Wal *wal, int type, u32 umbrella, u32 user, i16 start, i16 end);
+//queues a WAL_GROUP record and one WAL_ADD per umbrella, returns the lsn of the first WAL_ADD
+u64 walAppendGroup(Wal *wal, u32 user, u32 *ids, int n, i16 start, i16 end);
+//waits until the records appended by this thread are on disk
+void walCommit(Wal *wal);
+//switches to a new segment, returns its number
+u32 walRotate(Wal *wal);
+//thread writing the queued records with one fdatasync per batch
+void *walLoop(void *wal);
+//writes what is queued, then ends the thread and closes the segment
+void stopWal(Wal *wal);
+
+//reserves the days from start to end of the umbrella for leaseTime seconds, against
+//the other users' leases and, if checkBookings, the bookings; returns 0 if taken
+int takeLease(Season *season, u32 user, u32 idUmbrella, int start, int end, int checkBookings);
+void releaseLease(Season *season, u32 user, u32 idUmbrella);
+
+void initArena(Arena *arena);
+//returns room for count bookings or more, capacity gets how many fit
+Booking *arenaAlloc(Arena *arena, u32 count, u32 *capacity);
+void arenaFree(Arena *arena, Booking *block, u32 capacity);
+//releases the chunks, the arrays still in them go as well
+void freeArena(Arena *arena);
 
-//lock for preventing multiple users to book at the same time
-int lockBooking(Season *season, u32 user, u32 idUmbrella);
-void unlockBooking(Season *season, u32 idUmbrella);
+//copies the bookings of a list in order, to be called with the mutex held
+void copyBookings(BookingList *list, Booking *out);
+//removes the booking of the user starting on start, to be called with the mutex held
+//returns -1 if there is no such booking
+int deleteBooking(Season *season, u32 idUmbrella, u32 user, i16 start);
+//frees the bookings owned by a list, the snapshot mapping is left alone
+void freeBookings(Season *season, BookingList *list);
+
+//indexes the loaded bookings by user, from then on the index follows every change
+void buildUserIndex(Season *season);
+//copies the bookings of the user into a new array, returns how many they are
+int userBookings(Season *season, u32 user, UserBooking **out);
+//removes every booking of the user, returns how many umbrellas were freed
+int removeAllBookings(Season *season, u32 user);
 
 int removeBooking(Season *season, u32 user, u32 idUmbrella);
 int addBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end);
-int testBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end);
+//books all the umbrellas or none of them
+int addGroupBooking(Season *season, u32 user, u32 *ids, int n, i16 start, i16 end);
+//parses "umbrella user start end", returns -1 if the row is invalid
+int parseBulkRow(Season *season, char **toks, int nToks, BulkRow *row);
+//sorts the rows by umbrella and start and books them locking each list once, a row
+//overlapping a booking or another user's lease is rejected unless it is the same booking
+void bulkBookings(Season *season, BulkRow *rows, int n);
+//finds n adjacent umbrellas of a row free from start to end, returns the first or -1
+int findAdjacent(Season *season, int row, int n, int start, int end);
+
+//sets (value 1) or clears the days from start to end of the umbrella, in its day map
+//and in the bitsets of those days
+void markDays(Season *season, u32 idUmbrella, int start, int end, int value);
+//fills the bitset avail with the umbrellas in [first, last) free from start to end,
+//returns how many they are
+int findAvailable(Season *season, int start, int end, u32 first, u32 last, u64 *avail);
 
 //write text to a socket
 int swrite(int socket, char *text);
-//read from a socket and split into tokens
-int readToks(int csd, char *buffer, size_t bufferSize, char *toks[], int maxToks);
+//writes the decimal digits of value at p, returns the end
+char *formatUint(char *p, u32 value);
+//writes " id" for each umbrella of the bitset in [first, last) at p, returns the end;
+//idsSize is the room it may need
+char *formatIds(char *p, u64 *bits, u32 first, u32 last);
+size_t idsSize(u32 first, u32 last);
+//split a command into tokens
+int splitToks(char *line, char *toks[], int maxToks);
+
+//commands are terminated by a newline (or a NUL), more than one can arrive in a read
+//reads what is available into the receive ring, returns -1 once the peer closed
+int fillInput(Connection *conn);
+//returns 1 if a whole command is waiting in the ring
+int hasCommand(Connection *conn);
+//moves the next command into line, returns 0 if there is none
+int nextCommand(Connection *conn, char *line);
+//executes the buffered commands and sends their replies, returns -1 to close
+int processInput(Connection *conn);
+
+//queue a reply, owned replies are heap strings freed once copied
+void reply(Connection *conn, char *text);
+void replyOwned(Connection *conn, char *text);
+//queue len bytes of data
+void replyData(Connection *conn, void *data, size_t len);
+//room for len more bytes at the end of the output, to be committed by moving out.len
+char *outReserve(Connection *conn, size_t len);
+//waits for the log records acknowledged by the replies and sends them
+void flushReplies(Connection *conn);
+//writes what the socket takes, returns -1 on error, 1 if some output is left
+int writeOutput(Connection *conn);
 
-//thread for communication with a single user
-void *socketListener(void *commSocket);
-//thread for accepting users connections
-void *socketAccept(void *masterSocket);
+//executes the command parsed in conn->toks, returns -1 if the connection must be closed
+int handleCommand(Connection *conn);
+//same for a request of the binary protocol
+int handleBinary(Connection *conn, BinRequest *req);
 
-void initConnectionList(ConnectionList *conns);
+void initJobQueue(JobQueue *queue);
+void pushJob(JobQueue *queue, Connection *conn);
+//returns NULL on empty queue unless wait is set and the queue is not stopped
+Connection *popJob(JobQueue *queue, int wait);
+
+void initServer(Server *server);
+//thread waiting for socket events and parsing commands
+void *reactorLoop(void *reactor);
+//thread executing the parsed commands of the connections using a season
+void *workerLoop(void *season);
+//hands a new socket to one of the reactors
+void attachConnection(Server *server, Connection *conn);
+//stops the threads using the client sockets: the listeners, then the reactors, then
+//the workers once they have run the commands they were given
+void stopServer(Server *server);
+
+//loads the season of a beach from its config and starts its threads
+Season *openSeason(const char *name, const char *dir, const char *config, Server *server);
+//locks the config of the season, returns -1 if another process holds it
+int lockSeason(Season *season, const char *config);
+//saves the season, stops its threads and frees it
+void closeSeason(Season *season);
+//frees the lists of a season with no threads left
+void freeSeason(Season *season);
+//takes a reference to a loaded beach, NULL is the main one, returns NULL if not loaded
+Season *acquireSeason(const char *name);
+//drops a reference, the last one closes the season in the background
+void releaseSeason(Season *season);
+//loads the beach in beachDir/name, returns -1 if it is missing or already loaded
+int loadBeach(const char *name);
+//takes a beach out of the registry, it is closed once no connection uses it
+int unloadBeach(const char *name);
+//path of a file of the season
+void seasonPath(Season *season, char *out, size_t len, const char *file);
+
+void initConnectionList(ConnectionList *conns, u32 max);
+//returns NULL once max connections are open, lock-free unless the table grows
 Connection *addConnection(ConnectionList *conns, int csd);
 void removeConnection(ConnectionList *conns, int id);
-void closeConnections(ConnectionList *conns, Season *season);
+void closeConnections(ConnectionList *conns);
+//open connections of all the shards
+u32 openConnections();
+//thread accepting the connections of a shard on its own SO_REUSEPORT socket
+void *listenLoop(void *conns);
 
 //macro for detecting errors
 #define CHECK(RESULT) if ((RESULT) == -1) _exitErrno(errno, #RESULT , __LINE__)
 #define exitError(id, msg) _exitError(id, msg, __LINE__)
 void _exitError(int id, char *msg, int lineNumber) {
-  mprintf("error: %d, %s\nat line: %d\n", id, msg, lineNumber);
+  logPrint(LOG_ERROR, "error: %d, %s\nat line: %d\n", id, msg, lineNumber);
+  logFlush();
   exit(id);
 }
 
 void _exitErrno(int id, char *source, int lineNumber) {
-  mprintf("line: %d - %s, error: %s\n", lineNumber, source, strerror(id));
+  logPrint(LOG_ERROR, "line: %d - %s, error: %s\n", lineNumber, source, strerror(id));
+  logFlush();
   exit(id);
 }
 
 void term(int sig) {
-  closeConnections(conns, season);
-  close(conns->msd);
-  saveBookingList(season);
+  //no thread may be using a socket once it is closed
+  stopServer(server);
+  for (int i = 0; i < server->nListeners; i++) {
+    closeConnections(conns + i);
+    close(conns[i].msd);
+  }
+  //stopServer keeps a reference on every beach still in use, one without has a closer
+  //saving it already
+  pthread_mutex_lock(&beaches.mutex);
+  for (int i = 0; i < beaches.count; i++) {
+    Season *season = beaches.season[i];
+    if (!season->readOnly && __atomic_load_n(&season->refs, __ATOMIC_ACQUIRE))
+      saveBookingList(season);
+  }
+  pthread_mutex_unlock(&beaches.mutex);
   mprintf("exit!\n");
+  logFlush();
   exit(0);
 }
 
+static __thread LogRing *myRing;
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static u64 logDrain();
+
+//the records of a thread that exits are written before its ring is freed
+static void freeRing(void *arg) {
+  LogRing *ring = arg;
+  logDrain();
+  pthread_mutex_lock(&logger.mutex);
+  LogRing **p = &logger.rings;
+  while (*p != ring) p = &(*p)->next;
+  *p = ring->next;
+  pthread_mutex_unlock(&logger.mutex);
+  free(ring);
+  myRing = NULL;
+}
+
+static void initRingKey() {
+  pthread_key_create(&ringKey, freeRing);
+}
+
+static void logWrite(int level, const char *format, va_list args) {
+  if (level < logger.level) return;
+  if (!myRing) {
+    pthread_once(&ringOnce, initRingKey);
+    myRing = calloc(1, sizeof(LogRing));
+    pthread_setspecific(ringKey, myRing);
+    pthread_mutex_lock(&logger.mutex);
+    myRing->next = logger.rings;
+    logger.rings = myRing;
+    pthread_mutex_unlock(&logger.mutex);
+  }
+  LogRing *ring = myRing;
+
+  char line[LOG_LINE];
+  int len = vsnprintf(line, sizeof(line), format, args);
+  if (len < 0) return;
+  if (len >= LOG_LINE) len = LOG_LINE - 1;
+  u32 size = sizeof(LogRecord) + ((len + 7) & ~7);
+
+  u64 head = ring->head;
+  while (head + size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING) {
+    if (!logger.block || !logger.running) {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    struct timespec wait = {0, 1000000};
+    nanosleep(&wait, NULL);
+  }
+
+  //the record may wrap around the end of the ring, copied in two pieces
+  LogRecord record = {len, level};
+  char *parts[2] = {(char *)&record, line};
+  u32 lens[2] = {sizeof(record), len};
+  u64 pos = head;
+  for (int p = 0; p < 2; p++) {
+    u32 off = pos % LOG_RING, first = lens[p];
+    if (first > LOG_RING - off) first = LOG_RING - off;
+    memcpy(ring->buf + off, parts[p], first);
+    memcpy(ring->buf, parts[p] + first, lens[p] - first);
+    pos += p ? ((lens[p] + 7) & ~7) : lens[p];
+  }
+  __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+void logPrint(int level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  logWrite(level, format, args);
+  va_end(args);
+}
+
 void mprintf(const char *format, ...) {
   va_list args;
-  va_start (args, format);
-  pthread_mutex_lock(&logMutex);
-  vfprintf(logStream, format, args);
-  fflush(logStream);
-  pthread_mutex_unlock(&logMutex);
+  va_start(args, format);
+  logWrite(LOG_INFO, format, args);
   va_end(args);
 }
 
+static void logRotate() {
+  fclose(logStream);
+  char old[256];
+  snprintf(old, sizeof(old), "%s.1", logFile);
+  rename(logFile, old);
+  logStream = fopen(logFile, "w");
+  logger.size = 0;
+}
+
+//copies out every complete record, returns the number of bytes written
+static u64 logDrain() {
+  u64 written = 0;
+  pthread_mutex_lock(&logger.mutex);
+  for (LogRing *ring = logger.rings; ring; ring = ring->next) {
+    u64 tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (tail < head) {
+      LogRecord record;
+      char line[LOG_LINE];
+      for (u32 i = 0; i < sizeof(record); i++)
+        ((char *)&record)[i] = ring->buf[(tail + i) % LOG_RING];
+      for (u32 i = 0; i < record.len; i++)
+        line[i] = ring->buf[(tail + sizeof(record) + i) % LOG_RING];
+      tail += sizeof(record) + ((record.len + 7) & ~7);
+      if (logStream) fwrite(line, 1, record.len, logStream);
+      written += record.len;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    u64 dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped && logStream) written += fprintf(logStream, "log: %llu righe perse\n",
+        (unsigned long long)dropped);
+  }
+  if (written && logStream) {
+    fflush(logStream);
+    logger.size += written;
+    if (logger.maxSize && logger.size >= logger.maxSize && logStream != stderr) logRotate();
+  }
+  pthread_mutex_unlock(&logger.mutex);
+  return written;
+}
+
+void logFlush() {
+  logDrain();
+}
+
+//drains in batches, sleeping longer while there is nothing to write
+static void *loggerLoop(void *arg) {
+  for (;;) {
+    struct timespec wait = {0, logDrain() ? 1000000 : 20000000};
+    nanosleep(&wait, NULL);
+  }
+  return NULL;
+}
+
+void startLogger() {
+  logger.running = 1;
+  pthread_create(&logger.thread, NULL, loggerLoop, NULL);
+}
+
 int dcatf(String *string, const char *format, ...) {
   va_list args;
   va_start (args, format);
@@ -191,6 +995,105 @@ int dcatf(String *string, const char *format, ...) {
   return tlen;
 }
 
+static int histIndex(u64 value) {
+  if (value < HIST_SUB) return value;
+  int msb = 63 - __builtin_clzll(value);
+  return (msb - 3) * HIST_SUB + ((value >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+static u64 histValue(int index) {
+  if (index < HIST_SUB) return index;
+  int msb = index / HIST_SUB + 3;
+  return (u64)(HIST_SUB + index % HIST_SUB) << (msb - 4);
+}
+
+void histRecord(Histogram *hist, u64 value) {
+  hist->bucket[histIndex(value)]++;
+  hist->count++;
+  hist->sum += value;
+  if (value > hist->max) hist->max = value;
+}
+
+void histMerge(Histogram *to, Histogram *from) {
+  for (int i = 0; i < HIST_BUCKETS; i++) to->bucket[i] += from->bucket[i];
+  to->count += from->count;
+  to->sum += from->sum;
+  if (from->max > to->max) to->max = from->max;
+}
+
+u64 histPercentile(Histogram *hist, double p) {
+  u64 rank = hist->count * p / 100;
+  u64 seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->bucket[i];
+    if (seen > rank) return histValue(i);
+  }
+  return hist->max;
+}
+
+u64 nowUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+Stats *allStats;
+Stats retiredStats; //of the threads that exited
+pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread Stats *myStats;
+static pthread_key_t statsKey;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+
+static void addStats(Stats *total, Stats *stats) {
+  for (int i = 0; i < N_CMDS; i++) histMerge(total->latency + i, stats->latency + i);
+  for (int i = 0; i < N_LOCKS; i++) histMerge(total->lockWait + i, stats->lockWait + i);
+  total->bytesIn += stats->bytesIn;
+  total->bytesOut += stats->bytesOut;
+}
+
+//the counters of a thread that exits are kept in the retired ones
+static void freeStats(void *arg) {
+  Stats *stats = arg;
+  pthread_mutex_lock(&statsMutex);
+  addStats(&retiredStats, stats);
+  Stats **p = &allStats;
+  while (*p != stats) p = &(*p)->next;
+  *p = stats->next;
+  pthread_mutex_unlock(&statsMutex);
+  free(stats);
+  myStats = NULL;
+}
+
+static void initStatsKey() {
+  pthread_key_create(&statsKey, freeStats);
+}
+
+Stats *threadStats() {
+  if (myStats) return myStats;
+  pthread_once(&statsOnce, initStatsKey);
+  myStats = calloc(1, sizeof(Stats));
+  pthread_setspecific(statsKey, myStats);
+  pthread_mutex_lock(&statsMutex);
+  myStats->next = allStats;
+  allStats = myStats;
+  pthread_mutex_unlock(&statsMutex);
+  return myStats;
+}
+
+void statLock(pthread_mutex_t *mutex, int lock) {
+  if (!pthread_mutex_trylock(mutex)) return;
+  u64 start = nowUsec();
+  pthread_mutex_lock(mutex);
+  histRecord(threadStats()->lockWait + lock, nowUsec() - start);
+}
+
+void mergeStats(Stats *total) {
+  pthread_mutex_lock(&statsMutex);
+  *total = retiredStats;
+  for (Stats *stats = allStats; stats; stats = stats->next) addStats(total, stats);
+  pthread_mutex_unlock(&statsMutex);
+}
+
 int isLeap(int year) {
   return (!(year % 4) && (year % 100)) || !(year % 400);
 }
@@ -205,10 +1108,22 @@ int getYday(int currentYear, int year, int mon, int mday) {
   return pdays[mon + 14 * isLeap(year)] + mday - 1;
 }
 
-int getCurrentYday() {
+//set by the today key of the config, -1 follows the clock
+static int fixedYday = -1;
+//day of the year set by the clock thread, -1 until it starts
+static int currentYday = -1;
+
+static int computeYday() {
+  if (fixedYday != -1) return fixedYday;
   time_t t = time(NULL);
-  struct tm *tm = localtime(&t);
-  return getYday(-1, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
+  struct tm tm;
+  localtime_r(&t, &tm);
+  return getYday(-1, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+int getCurrentYday() {
+  int day = __atomic_load_n(&currentYday, __ATOMIC_ACQUIRE);
+  return day >= 0 ? day : computeYday();
 }
 
 // returns - 1 if the date is not valid
@@ -231,27 +1146,32 @@ int getDateString(char *out, size_t len, int year, int yday) {
   int leap = isLeap(year);
   int max = leap ? 366 : 365;
   if (yday >= max) return -1;
+  const int *days = pdays + 14 * leap;
   int mon;
-  for (mon = 1; yday > pdays[mon+1]; mon++);
-  int mday = yday - pdays[mon] + 1;
+  for (mon = 1; yday >= days[mon+1]; mon++);
+  int mday = yday - days[mon] + 1;
   snprintf(out, len, "%02d/%02d/%04d", mday, mon, year);
   return 0;
 }
 
-void loadConfig(Season *season) {
-  FILE *fp = fopen(configfile, "r");
-  if (fp == NULL) exitError(-1, "config file not found");
+int loadConfig(Season *season, Server *server, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return -1;
 
   char *tokstate;
   char *line = NULL;
   size_t bufSize = 0;
   int count = 1;
+  int valid = 1;
   while (getline(&line, &bufSize, fp) != -1) {
     char *key = strtok_r(line, " =", &tokstate);
     char *value = strtok_r(NULL, " =", &tokstate);
     if (key == NULL) continue;
     if (key[0] == '#') continue;
-    if (value == NULL) exitError( -1, "invalid config file");
+    if (value == NULL) {
+      valid = 0;
+      break;
+    }
 
     if (!strcmp(key, "start")) {
       int yday = parseDate(value, -1);
@@ -267,484 +1187,3663 @@ void loadConfig(Season *season) {
     } else if (!strcmp(key, "cols")) {
       int nCols = atoi(value);
       season->nCols = nCols;
+    } else if (!strcmp(key, "checkpoint")) {
+      season->checkpointInterval = atoi(value);
+    } else if (!strcmp(key, "checkpoint_rate")) {
+      season->checkpointRate = atoi(value);
+    } else if (!strcmp(key, "lease")) {
+      season->leaseTime = atoi(value);
+    } else if (!strcmp(key, "workers")) {
+      season->nWorkers = atoi(value);
+    } else if (server == NULL) {
+      //the settings of the process only belong to the main config
+      valid = 0;
+      break;
+    } else if (!strcmp(key, "reactors")) {
+      server->nReactors = atoi(value);
+    } else if (!strcmp(key, "today")) {
+      fixedYday = parseDate(value, -1);
+      if (fixedYday == -1) {
+        valid = 0;
+        break;
+      }
+    } else if (!strcmp(key, "beach")) {
+      snprintf(season->name, sizeof(season->name), "%s", strtok_r(value, "\n", &tokstate));
+    } else if (!strcmp(key, "beaches")) {
+      server->beaches = strdup(strtok_r(value, "\n", &tokstate));
+    } else if (!strcmp(key, "port")) {
+      server->port = atoi(value);
+    } else if (!strcmp(key, "listeners")) {
+      server->nListeners = atoi(value);
+    } else if (!strcmp(key, "maxconn")) {
+      server->maxConn = atoi(value);
+    } else if (!strcmp(key, "metrics_port")) {
+      server->metricsPort = atoi(value);
+    } else if (!strcmp(key, "replication_port")) {
+      server->replPort = atoi(value);
+    } else if (!strcmp(key, "primary")) {
+      server->primaryPort = atoi(value);
+    } else if (!strcmp(key, "max_lag")) {
+      server->maxLag = atoi(value);
+    } else if (!strcmp(key, "log_level")) {
+      char *levels[] = {"debug", "info", "warn", "error"};
+      int level = -1;
+      for (int i = 0; i < 4; i++)
+        if (!strncmp(value, levels[i], strlen(levels[i]))) level = i;
+      if (level == -1) {
+        valid = 0;
+        break;
+      }
+      logger.level = level;
+    } else if (!strcmp(key, "log_size")) {
+      logger.maxSize = (u64)atoi(value) * 1024;
+    } else if (!strcmp(key, "log_full")) {
+      if (!strncmp(value, "block", 5)) logger.block = 1;
+      else if (!strncmp(value, "drop", 4)) logger.block = 0;
+      else {
+        valid = 0;
+        break;
+      }
     } else {
-      exitError( -1, "invalid config file");
+      valid = 0;
+      break;
     }
 
     count++;
   }
   if (season->nCols == 0 || season->nRows == 0 ||
       season->start == -1 || season->end == -1 ||
-      season->year == 0)
-    exitError( -1, "invalid config file");
+      season->year == 0 || season->nWorkers < 1 ||
+      season->leaseTime < 1 || season->leaseTime >= LEASE_SLOTS)
+    valid = 0;
+  //every listener needs at least one connection of its own
+  if (server && (server->nReactors < 1 || server->maxConn < 1 ||
+      server->nListeners < 1 || server->nListeners > server->maxConn ||
+      server->port < 1 || server->port > 65535))
+    valid = 0;
+  //a replica has nothing of its own to stream
+  if (server && (server->replPort < 0 || server->replPort > 65535 ||
+      server->primaryPort < 0 || server->primaryPort > 65535 || server->maxLag < 1 ||
+      (server->replPort && server->primaryPort)))
+    valid = 0;
 
   season->nUmbrella = season->nCols * season->nRows;
   fclose(fp);
   free(line);
+  return valid ? 0 : -1;
+}
+
+//seqlock around the changes visible to the lock-free readers, called with the mutex held
+static void beginWrite(Season *season, u32 idUmbrella) {
+  u32 *version = season->version + idUmbrella;
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endWrite(Season *season, u32 idUmbrella) {
+  u32 *version = season->version + idUmbrella;
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+static pthread_mutex_t *listMutex(Season *season, BookingList *list) {
+  return &season->lock[list - season->bookingList].mutex;
 }
 
 void initBookingList(Season *season) {
   season->bookingList = calloc(season->nUmbrella, sizeof(BookingList));
-  for (u32 i = 0; i < season->nUmbrella; i++) {
-    pthread_mutex_init(&(season->bookingList[i].mutex), NULL);
-  }
+  if (posix_memalign((void **)&season->lock, CACHE_LINE, season->nUmbrella * sizeof(ListLock)) ||
+      posix_memalign((void **)&season->days, CACHE_LINE, season->nUmbrella * sizeof(DayMap)))
+    exitError(-1, "out of memory.");
+  memset(season->days, 0, season->nUmbrella * sizeof(DayMap));
+  season->dayWords = BITSET_WORDS(season->nUmbrella);
+  season->byDay = calloc((season->end - season->start + 1) * season->dayWords, sizeof(u64));
+  season->version = calloc(season->nUmbrella, sizeof(u32));
+  season->dirty = calloc(season->nUmbrella, sizeof(u8));
+  for (u32 i = 0; i < season->nUmbrella; i++) pthread_mutex_init(&season->lock[i].mutex, NULL);
+  pthread_mutex_init(&season->checkpointMutex, NULL);
+  initArena(&season->arena);
+  season->leases.umbrella = calloc(season->nUmbrella, sizeof(Lease *));
+  season->leases.wheelTime = time(NULL);
+  pthread_mutex_init(&season->leases.mutex, NULL);
+}
+
+void seasonPath(Season *season, char *out, size_t len, const char *file) {
+  snprintf(out, len, "%s/%s", season->dir, file);
+}
+
+void walPath(Wal *wal, char *out, size_t len, u32 seq) {
+  snprintf(out, len, "%s.%u", wal->base, seq);
 }
 
 void saveBookingList(Season *season) {
-  FILE *fp = fopen(tempfile, "w");
-  if (fp == NULL) {
-    mprintf("failed to open file for writing.\n");
+  pthread_mutex_lock(&season->checkpointMutex);
+  //every record before the rotation is applied to the lists we are about to write
+  u32 seq = walRotate(&season->wal);
+
+  char path[WAL_PATH], temp[256], snap[256];
+  seasonPath(season, temp, sizeof(temp), tempfile);
+  seasonPath(season, snap, sizeof(snap), snapfile);
+  if (writeSnapshot(season, temp, seq)) {
+    logPrint(LOG_ERROR, "failed to open file for writing.\n");
+    pthread_mutex_unlock(&season->checkpointMutex);
     return;
   }
+  rename(temp, snap);
+  seasonPath(season, path, sizeof(path), deltafile);
+  unlink(path);
 
-  for (u32 i = 0; i < season->nUmbrella; i++) {
-    BookingList *list = season->bookingList + i;
-    pthread_mutex_lock(&list->mutex);
-    Booking *array = list->booking;
-    u32 count = list->count;
-    fprintf(fp, "%d %d %d", count, list->lockUser, list->lockDay);
-    for (u32 j = 0; j < count; j++) {
-      Booking *booking = array + j;
-      fprintf(fp, " %d %d %d", booking->user, booking->start, booking->end);
-    }
-    fprintf(fp, "\n");
-    pthread_mutex_unlock(&list->mutex);
+  for (u32 old = season->wal.firstSeq; old < seq; old++) {
+    walPath(&season->wal, path, sizeof(path), old);
+    unlink(path);
   }
-  fclose(fp);
+  season->wal.firstSeq = seq;
+  pthread_mutex_unlock(&season->checkpointMutex);
+}
 
-  remove(savefile);
-  rename(tempfile, savefile);
+//sleeps to keep the bytes written since begin under rate KB/s
+static void throttle(int rate, struct timespec *begin, u64 written) {
+  if (rate <= 0) return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) / 1e9;
+  double due = written / (rate * 1024.0);
+  if (due > elapsed) usleep((due - elapsed) * 1e6);
 }
 
-void loadBookingList(Season *season) {
-  FILE *fp;
-  fp = fopen(savefile, "r");
+void deltaCheckpoint(Season *season) {
+  //every logged change marks its list, nothing dirty means nothing to write
+  u32 i;
+  for (i = 0; i < season->nUmbrella; i++)
+    if (__atomic_load_n(season->dirty + i, __ATOMIC_RELAXED)) break;
+  if (i == season->nUmbrella) return;
+
+  pthread_mutex_lock(&season->checkpointMutex);
+  u32 seq = walRotate(&season->wal);
+
+  char path[WAL_PATH];
+  seasonPath(season, path, sizeof(path), deltafile);
+  FILE *fp = fopen(path, "a");
   if (fp == NULL) {
-    if (errno == ENOENT) {
-      mprintf("Il file 'data' non esiste, creazione di un nuovo database.\n");
-      return;
-    } else {
-      exitError(errno, "Impossibile aprire il file 'data'.");
+    logPrint(LOG_ERROR, "failed to open file for writing.\n");
+    pthread_mutex_unlock(&season->checkpointMutex);
+    return;
+  }
+
+  //the lists are copied under their mutex and written after releasing it
+  Booking *copy = NULL;
+  u32 copySize = 0;
+  u32 nDirty = 0;
+  u64 written = 0;
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (i = 0; i < season->nUmbrella; i++) {
+    //the writers mark before appending, so a change logged before the rotation shows here
+    if (!__atomic_load_n(season->dirty + i, __ATOMIC_ACQUIRE)) continue;
+    BookingList *list = season->bookingList + i;
+
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    DeltaEntry entry = {0};
+    entry.umbrella = i;
+    entry.count = list->count;
+    entry.lsn = list->lsn;
+    if (copySize < list->count) {
+      copySize = list->count;
+      copy = realloc(copy, copySize * sizeof(Booking));
     }
+    copyBookings(list, copy);
+    __atomic_store_n(season->dirty + i, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(listMutex(season, list));
+
+    fwrite(&entry, sizeof(entry), 1, fp);
+    fwrite(copy, sizeof(Booking), entry.count, fp);
+    written += sizeof(entry) + entry.count * sizeof(Booking);
+    nDirty++;
+    throttle(season->checkpointRate, &begin, written);
   }
+  free(copy);
 
-  char *line = NULL;
-  size_t bufSize = 0;
-  for (u32 i = 0; i < season->nUmbrella; i++) {
-    if (getline(&line, &bufSize, fp) == -1) exitError(i, "this line is missing.");
+  DeltaEntry commit = {0};
+  commit.umbrella = DELTA_COMMIT;
+  commit.count = seq;
+  fwrite(&commit, sizeof(commit), 1, fp);
+  fflush(fp);
+  fsync(fileno(fp));
+  int error = ferror(fp);
+  long size = ftell(fp);
+  fclose(fp);
+  if (error) {
+    logPrint(LOG_ERROR, "failed to write the checkpoint.\n");
+    pthread_mutex_unlock(&season->checkpointMutex);
+    return;
+  }
 
-    BookingList *list = season->bookingList + i;
-    pthread_mutex_lock(&list->mutex);
+  for (u32 old = season->wal.firstSeq; old < seq; old++) {
+    walPath(&season->wal, path, sizeof(path), old);
+    unlink(path);
+  }
+  season->wal.firstSeq = seq;
+  pthread_mutex_unlock(&season->checkpointMutex);
+  if (nDirty) mprintf("Checkpoint: %u ombrelloni salvati.\n", nDirty);
 
-    char *tokstate;
-    char *countToken = strtok_r(line, " ", &tokstate);
-    char *userToken = strtok_r(NULL, " ", &tokstate);
-    char *dayToken = strtok_r(NULL, " ", &tokstate);
-    if (dayToken == NULL) exitError(i, "error on parsing this line of file.");
-    u32 count = atoi(countToken);
-    list->booking = realloc(list->booking, count * sizeof(Booking));
-    list->count = count;
-    list->capacity = count;
-    list->lockUser = atoi(userToken);
-    list->lockDay = atoi(dayToken);
+  //once the delta outgrows the snapshot it is folded into a new one
+  struct stat st;
+  seasonPath(season, path, sizeof(path), snapfile);
+  if (size > (1 << 20) && (stat(path, &st) || size > st.st_size))
+    saveBookingList(season);
+}
 
-    for (u32 j = 0; j < count; j++) {
-      char *user = strtok_r(NULL, " ", &tokstate);
-      char *start = strtok_r(NULL, " ", &tokstate);
-      char *end = strtok_r(NULL, " ", &tokstate);
-      if (end == NULL) exitError(i, "too few arguments on this line.");
-      Booking *booking = list->booking + j;
-      booking->user = atoi(user);
-      booking->start = atoi(start);
-      booking->end = atoi(end);
-      if (booking->start > booking->end) exitError(i, "invalid booking.");
+void loadDelta(Season *season, u32 *walSeq, u64 *lastLsn) {
+  char path[256];
+  seasonPath(season, path, sizeof(path), deltafile);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return;
+
+  //only the checkpoints closed by their commit entry are applied
+  DeltaEntry entry;
+  long committed = 0;
+  while (fread(&entry, sizeof(entry), 1, fp) == 1) {
+    if (entry.umbrella == DELTA_COMMIT) {
+      committed = ftell(fp);
+      if (entry.count > *walSeq) *walSeq = entry.count;
+    } else if (entry.umbrella >= season->nUmbrella ||
+        fseek(fp, entry.count * sizeof(Booking), SEEK_CUR)) break;
+  }
+
+  rewind(fp);
+  while (ftell(fp) < committed && fread(&entry, sizeof(entry), 1, fp) == 1) {
+    if (entry.umbrella == DELTA_COMMIT) continue;
+    BookingList *list = season->bookingList + entry.umbrella;
+    if (entry.lsn <= list->lsn) {
+      fseek(fp, entry.count * sizeof(Booking), SEEK_CUR);
+      continue;
     }
-    if (strtok_r(NULL, " ", &tokstate) != NULL) exitError(i, " too many arguments on this line.");
-    pthread_mutex_unlock(&list->mutex);
+    freeBookings(season, list);
+    list->booking = arenaAlloc(&season->arena, entry.count, &list->capacity);
+    if (fread(list->booking, sizeof(Booking), entry.count, fp) != entry.count)
+      exitError(entry.umbrella, "truncated checkpoint.");
+    list->count = entry.count;
+    list->lsn = entry.lsn;
+    if (list->lsn > *lastLsn) *lastLsn = list->lsn;
+    markDays(season, entry.umbrella, 0, SEASON_DAYS - 1, 0);
+    for (u32 j = 0; j < entry.count; j++)
+      markDays(season, entry.umbrella, list->booking[j].start, list->booking[j].end, 1);
   }
   fclose(fp);
-  free(line);
-  mprintf("Database caricato in memoria.\n");
+  mprintf("Checkpoint incrementali caricati.\n");
 }
 
-void unlockBooking(Season *season, u32 idUmbrella) {
-  if (idUmbrella >= season->nUmbrella) return;
-  BookingList *list = season->bookingList + idUmbrella;
-  pthread_mutex_lock(&list->mutex);
-  list->lockUser = 0;
-  list->lockDay = 0;
-  pthread_mutex_unlock(&list->mutex);
+void *checkpointLoop(void *arg) {
+  Season *season = (Season *)arg;
+  for (;;) {
+    for (int i = 0; i < season->checkpointInterval; i++) {
+      if (__atomic_load_n(&season->stop, __ATOMIC_ACQUIRE)) return NULL;
+      sleep(1);
+    }
+    deltaCheckpoint(season);
+  }
+  return NULL;
 }
 
-int lockBooking(Season *season, u32 user, u32 idUmbrella) {
-  if (idUmbrella >= season->nUmbrella) return 0;
-  BookingList *list = season->bookingList + idUmbrella;
-  pthread_mutex_lock(&list->mutex);
-  int today = getCurrentYday();
-  int avail = (user == 0 || list->lockUser == 0 || list->lockUser == user || list->lockDay < today);
-  if (avail) {
-    list->lockUser = user;
-    list->lockDay = today;
+int writeSnapshot(Season *season, const char *path, u32 walSeq) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) return -1;
+
+  SnapHeader header = {0};
+  header.magic = SNAP_MAGIC;
+  header.version = SNAP_VERSION;
+  header.walSeq = walSeq;
+  header.nRows = season->nRows;
+  header.nCols = season->nCols;
+  header.year = season->year;
+  header.start = season->start;
+  header.end = season->end;
+  header.nUmbrella = season->nUmbrella;
+
+  //the tables are written at the end, once the offsets are known
+  SnapEntry *entry = calloc(season->nUmbrella, sizeof(SnapEntry));
+  DayMap *days = malloc(season->nUmbrella * sizeof(DayMap));
+  long base = sizeof(header) + season->nUmbrella * (sizeof(SnapEntry) + sizeof(DayMap));
+  fseek(fp, base, SEEK_SET);
+
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    entry[i].offset = header.nBooking;
+    entry[i].lsn = list->lsn;
+    entry[i].count = list->count;
+    memcpy(days[i], season->days[i], sizeof(DayMap));
+    __atomic_store_n(season->dirty + i, 0, __ATOMIC_RELAXED);
+    fwrite(list->booking, sizeof(Booking), list->count, fp);
+    header.nBooking += list->count;
+    pthread_mutex_unlock(listMutex(season, list));
   }
-  pthread_mutex_unlock(&list->mutex);
-  return avail;
+
+  fseek(fp, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(entry, sizeof(SnapEntry), season->nUmbrella, fp);
+  fwrite(days, sizeof(DayMap), season->nUmbrella, fp);
+  free(entry);
+  free(days);
+
+  fflush(fp);
+  fsync(fileno(fp));
+  int error = ferror(fp);
+  fclose(fp);
+  return error ? -1 : 0;
 }
 
-int removeBooking(Season *season, u32 user, u32 idUmbrella) {
-  if (idUmbrella >= season->nUmbrella) return -1;
+int loadSnapshot(Season *season, u32 *walSeq, u64 *lastLsn) {
+  char path[256];
+  seasonPath(season, path, sizeof(path), snapfile);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return -1;
+    exitError(errno, "Impossibile aprire lo snapshot.");
+  }
+  struct stat st;
+  CHECK(fstat(fd, &st));
+  if (st.st_size < sizeof(SnapHeader)) exitError(-1, "invalid snapshot.");
+  void *snap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (snap == MAP_FAILED) _exitErrno(errno, "mmap", __LINE__);
+  close(fd);
 
-  BookingList *list = season->bookingList + idUmbrella;
-  pthread_mutex_lock(&list->mutex);
-  Booking *array = list->booking;
+  SnapHeader *header = snap;
+  if (header->magic != SNAP_MAGIC || header->version != SNAP_VERSION)
+    exitError(-1, "invalid snapshot.");
+  //the day bits are indexes in the season, they mean other dates in another one
+  if (header->nRows != season->nRows || header->nCols != season->nCols ||
+      header->year != season->year || header->start != season->start || header->end != season->end)
+    exitError(-1, "the snapshot does not match the config file.");
+  SnapEntry *entry = (SnapEntry *)(header + 1);
+  DayMap *days = (DayMap *)(entry + header->nUmbrella);
+  Booking *booking = (Booking *)(days + header->nUmbrella);
+  if ((char *)(booking + header->nBooking) > (char *)snap + st.st_size)
+    exitError(-1, "truncated snapshot.");
 
-  for (int i = list->count-1; i >= 0; i--) {
-    if (array[i].user == user) {
-      list->count--;
-      if (i <= list->count)
-        memmove(array + i, array + i + 1, (list->count - i) * sizeof(Booking));
-    }
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    //the day bitsets are not in the file, they follow the day maps
+    for (int w = 0; w < DAY_WORDS; w++)
+      for (u64 bits = days[i][w]; bits; bits &= bits - 1) {
+        int day = w * 64 + __builtin_ctzll(bits);
+        markDays(season, i, day, day, 1);
+      }
+    BookingList *list = season->bookingList + i;
+    if (entry[i].offset + entry[i].count > header->nBooking)
+      exitError(i, "invalid snapshot entry.");
+    //capacity below count marks a list still served from the mapping
+    list->booking = entry[i].count ? booking + entry[i].offset : NULL;
+    list->count = entry[i].count;
+    list->capacity = 0;
+    list->lsn = entry[i].lsn;
+    if (list->lsn > *lastLsn) *lastLsn = list->lsn;
   }
 
-  pthread_mutex_unlock(&list->mutex);
+  season->snap = snap;
+  season->snapSize = st.st_size;
+  *walSeq = header->walSeq;
+  mprintf("Snapshot caricato in memoria.\n");
   return 0;
 }
 
-int _testSetBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end, int testOnly) {
+void exportBookingList(Season *season, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    logPrint(LOG_ERROR, "failed to open file for writing.\n");
+    return;
+  }
+
+  //the segments still on disk can be replayed on top of the export
+  fprintf(fp, "#beach 2 %u\n", season->wal.firstSeq);
+  Booking *copy = NULL;
+  u32 copySize = 0;
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    u32 count = list->count;
+    if (copySize < count) {
+      copySize = count;
+      copy = realloc(copy, copySize * sizeof(Booking));
+    }
+    copyBookings(list, copy);
+    //the two fields of the old day locks are kept for the readers of the format
+    fprintf(fp, "%d 0 0 %llu", count, (unsigned long long)list->lsn);
+    pthread_mutex_unlock(listMutex(season, list));
+    for (u32 j = 0; j < count; j++) {
+      Booking *booking = copy + j;
+      fprintf(fp, " %d %d %d", booking->user, booking->start, booking->end);
+    }
+    fprintf(fp, "\n");
+  }
+  free(copy);
+  fclose(fp);
+}
+
+static u32 hashUser(u32 user) {
+  return user * 2654435761u;
+}
+
+//returns the slot of the user, adding it if missing, to be called with the stripe mutex held
+static UserEntry *findUser(UserStripe *stripe, u32 user, int add) {
+  if (add && (stripe->used + 1) * 4 > stripe->size * 3) {
+    UserEntry *old = stripe->entry;
+    u32 oldSize = stripe->size;
+    stripe->size = oldSize ? oldSize * 2 : 16;
+    stripe->entry = calloc(stripe->size, sizeof(UserEntry));
+    for (u32 i = 0; i < oldSize; i++) {
+      if (!old[i].capacity) continue;
+      u32 j = (hashUser(old[i].user) / USER_STRIPES) & (stripe->size - 1);
+      while (stripe->entry[j].capacity) j = (j + 1) & (stripe->size - 1);
+      stripe->entry[j] = old[i];
+    }
+    free(old);
+  }
+  if (!stripe->size) return NULL;
+
+  u32 i = (hashUser(user) / USER_STRIPES) & (stripe->size - 1);
+  for (; stripe->entry[i].capacity; i = (i + 1) & (stripe->size - 1))
+    if (stripe->entry[i].user == user) return stripe->entry + i;
+  if (!add) return NULL;
+  UserEntry *entry = stripe->entry + i;
+  entry->user = user;
+  entry->capacity = 4;
+  entry->booking = malloc(entry->capacity * sizeof(UserBooking));
+  stripe->used++;
+  return entry;
+}
+
+static void indexBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end, int add) {
+  if (!season->users) return;
+  UserStripe *stripe = season->users + hashUser(user) % USER_STRIPES;
+  pthread_mutex_lock(&stripe->mutex);
+  UserEntry *entry = findUser(stripe, user, add);
+  if (add) {
+    if (entry->count == entry->capacity) {
+      entry->capacity *= 2;
+      entry->booking = realloc(entry->booking, entry->capacity * sizeof(UserBooking));
+    }
+    UserBooking booking = {idUmbrella, start, end};
+    entry->booking[entry->count++] = booking;
+  } else if (entry) {
+    //the order of the bookings of a user does not matter, the last one fills the hole
+    for (u32 i = 0; i < entry->count; i++) {
+      if (entry->booking[i].umbrella == idUmbrella && entry->booking[i].start == start) {
+        entry->booking[i] = entry->booking[--entry->count];
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+}
+
+void buildUserIndex(Season *season) {
+  UserStripe *users = calloc(USER_STRIPES, sizeof(UserStripe));
+  for (int i = 0; i < USER_STRIPES; i++) pthread_mutex_init(&users[i].mutex, NULL);
+  season->users = users;
+
+  Booking *copy = NULL;
+  u32 copySize = 0;
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    if (copySize < list->count) {
+      copySize = list->count;
+      copy = realloc(copy, copySize * sizeof(Booking));
+    }
+    copyBookings(list, copy);
+    for (u32 j = 0; j < list->count; j++)
+      indexBooking(season, copy[j].user, i, copy[j].start, copy[j].end, 1);
+    pthread_mutex_unlock(listMutex(season, list));
+  }
+  free(copy);
+}
+
+int userBookings(Season *season, u32 user, UserBooking **out) {
+  *out = NULL;
+  if (!season->users) return 0;
+  UserStripe *stripe = season->users + hashUser(user) % USER_STRIPES;
+  pthread_mutex_lock(&stripe->mutex);
+  UserEntry *entry = findUser(stripe, user, 0);
+  int count = entry ? entry->count : 0;
+  if (count) {
+    *out = malloc(count * sizeof(UserBooking));
+    memcpy(*out, entry->booking, count * sizeof(UserBooking));
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+  return count;
+}
+
+void initArena(Arena *arena) {
+  memset(arena, 0, sizeof(Arena));
+  for (int i = 0; i < SLAB_CLASSES; i++) pthread_mutex_init(&arena->slab[i].mutex, NULL);
+  pthread_mutex_init(&arena->mutex, NULL);
+}
+
+Booking *arenaAlloc(Arena *arena, u32 count, u32 *capacity) {
+  if (count == 0) {
+    *capacity = 0;
+    return NULL;
+  }
+  int c = 0;
+  while (c < SLAB_CLASSES && (1u << c) < count) c++;
+  if (c == SLAB_CLASSES) {
+    *capacity = count;
+    __atomic_add_fetch(&arena->used, count * sizeof(Booking), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&arena->reserved, count * sizeof(Booking), __ATOMIC_RELAXED);
+    return malloc(count * sizeof(Booking));
+  }
+  *capacity = 1u << c;
+  size_t size = *capacity * sizeof(Booking);
+  SlabClass *slab = arena->slab + c;
+  pthread_mutex_lock(&slab->mutex);
+  void *block = slab->free;
+  if (block) {
+    slab->free = *(void **)block;
+  } else {
+    if (slab->next == NULL || slab->next + size > slab->limit) {
+      char *chunk = malloc(SLAB_CHUNK);
+      pthread_mutex_lock(&arena->mutex);
+      arena->chunk = realloc(arena->chunk, (arena->nChunks + 1) * sizeof(char *));
+      arena->chunk[arena->nChunks++] = chunk;
+      pthread_mutex_unlock(&arena->mutex);
+      __atomic_add_fetch(&arena->reserved, SLAB_CHUNK, __ATOMIC_RELAXED);
+      slab->next = chunk;
+      slab->limit = chunk + SLAB_CHUNK;
+    }
+    block = slab->next;
+    slab->next += size;
+  }
+  pthread_mutex_unlock(&slab->mutex);
+  __atomic_add_fetch(&arena->used, size, __ATOMIC_RELAXED);
+  return block;
+}
+
+void arenaFree(Arena *arena, Booking *block, u32 capacity) {
+  if (block == NULL) return;
+  __atomic_sub_fetch(&arena->used, capacity * sizeof(Booking), __ATOMIC_RELAXED);
+  if (capacity > 1u << (SLAB_CLASSES - 1)) {
+    __atomic_sub_fetch(&arena->reserved, capacity * sizeof(Booking), __ATOMIC_RELAXED);
+    free(block);
+    return;
+  }
+  SlabClass *slab = arena->slab + __builtin_ctz(capacity);
+  pthread_mutex_lock(&slab->mutex);
+  *(void **)block = slab->free;
+  slab->free = block;
+  pthread_mutex_unlock(&slab->mutex);
+}
+
+void freeArena(Arena *arena) {
+  for (u32 i = 0; i < arena->nChunks; i++) free(arena->chunk[i]);
+  free(arena->chunk);
+  for (int i = 0; i < SLAB_CLASSES; i++) pthread_mutex_destroy(&arena->slab[i].mutex);
+  pthread_mutex_destroy(&arena->mutex);
+}
+
+//copies a list out of the snapshot mapping before it is modified
+static void ownBookings(Season *season, BookingList *list) {
+  if (list->capacity >= list->count) return;
+  Booking *copy = arenaAlloc(&season->arena, list->count, &list->capacity);
+  memcpy(copy, list->booking, list->count * sizeof(Booking));
+  list->booking = copy;
+}
+
+void freeBookings(Season *season, BookingList *list) {
+  if (list->capacity >= list->count) {
+    arenaFree(&season->arena, list->booking, list->capacity);
+  }
+  list->booking = NULL;
+  list->count = list->capacity = 0;
+}
+
+void copyBookings(BookingList *list, Booking *out) {
+  memcpy(out, list->booking, list->count * sizeof(Booking));
+}
+
+//the bookings never overlap, so sorting them by start also sorts them by end
+//returns the first booking ending on day or later, index of the array or -1
+static int findBooking(BookingList *list, i16 day) {
+  u32 low = 0, high = list->count;
+  while (low < high) {
+    u32 mid = (low + high) / 2;
+    if (list->booking[mid].end < day) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+static int busyOn(Season *season, u32 idUmbrella, int day) {
+  return (__atomic_load_n(season->days[idUmbrella] + day / 64, __ATOMIC_RELAXED) >> (day % 64)) & 1;
+}
+
+static void setFree(Season *season, DaySet *set, u32 idUmbrella, int day) {
+  u64 *word = set->free + idUmbrella / 64, bit = 1ULL << (idUmbrella % 64);
+  if (busyOn(season, idUmbrella, day)) __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+  else __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+}
+
+//updates the umbrella in the free set of today, to be called with its list mutex held;
+//a rollover scans the umbrella under the same mutex, before or after it is in its set too
+static void updateToday(Season *season, u32 idUmbrella) {
+  DayCache *cache = &season->today;
+  DaySet *next = __atomic_load_n(&cache->next, __ATOMIC_ACQUIRE);
+  DaySet *set = __atomic_load_n(&cache->set, __ATOMIC_ACQUIRE);
+  if (set == NULL) return;
+  if (next) setFree(season, next, idUmbrella, cache->nextDay);
+  int day = __atomic_load_n(&set->day, __ATOMIC_ACQUIRE);
+  if (day != -1) setFree(season, set, idUmbrella, day);
+  __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+}
+
+//builds the free set of the current day aside and publishes it with its day in one store,
+//to be called with the cache mutex held; the readers still on the set it reuses see its
+//day change and read the lists instead
+void rollToday(Season *season) {
+  DayCache *cache = &season->today;
+  DaySet *next = cache->spare;
+  cache->nextDay = getCurrentYday();
+  __atomic_store_n(&next->day, -1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&cache->next, next, __ATOMIC_RELEASE);
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    setFree(season, next, i, cache->nextDay);
+    pthread_mutex_unlock(listMutex(season, list));
+  }
+  __atomic_store_n(&next->day, cache->nextDay, __ATOMIC_RELEASE);
+  cache->spare = cache->set;
+  __atomic_store_n(&cache->set, next, __ATOMIC_RELEASE);
+  __atomic_store_n(&cache->next, NULL, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+}
+
+static DaySet *newDaySet(Season *season) {
+  DaySet *set = calloc(1, sizeof(DaySet) + BITSET_WORDS(season->nUmbrella) * sizeof(u64));
+  set->day = -1;
+  return set;
+}
+
+void initToday(Season *season) {
+  DayCache *cache = &season->today;
+  pthread_mutex_init(&cache->mutex, NULL);
+  cache->spare = newDaySet(season);
+  cache->set = newDaySet(season);
+  pthread_mutex_lock(&cache->mutex);
+  rollToday(season);
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+void *clockLoop(void *arg) {
+  __atomic_store_n(&currentYday, computeYday(), __ATOMIC_RELEASE);
+  for (;;) {
+    //woken at least every minute, the clock of the system may be moved meanwhile
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int left = 24 * 3600 - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+    sleep(left < 60 ? left : 60);
+
+    int day = computeYday();
+    if (day == __atomic_load_n(&currentYday, __ATOMIC_ACQUIRE)) continue;
+    __atomic_store_n(&currentYday, day, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&beaches.mutex);
+    for (int i = 0; i < beaches.count; i++) {
+      DayCache *cache = &beaches.season[i]->today;
+      pthread_mutex_lock(&cache->mutex);
+      rollToday(beaches.season[i]);
+      pthread_mutex_unlock(&cache->mutex);
+    }
+    pthread_mutex_unlock(&beaches.mutex);
+    logPrint(LOG_DEBUG, "nuovo giorno %d\n", day);
+  }
+  return NULL;
+}
+
+//marks an umbrella whose days changed for the watchers, every reactor hears of it
+//once per pass however many changes come in between
+static void notifyChange(Season *season, u32 idUmbrella) {
+  updateToday(season, idUmbrella);
+  if (!__atomic_load_n(&season->watchers, __ATOMIC_ACQUIRE)) return;
+  u32 words = BITSET_WORDS(season->nUmbrella);
+  for (int i = 0; i < server->nReactors; i++) {
+    __atomic_fetch_or(season->changed + i * words + idUmbrella / 64, 1ULL << (idUmbrella % 64),
+        __ATOMIC_RELAXED);
+    Reactor *reactor = server->reactor + i;
+    if (!__atomic_exchange_n(&reactor->notify, 1, __ATOMIC_ACQ_REL)) {
+      u64 one = 1;
+      write(reactor->wakefd, &one, sizeof(one));
+    }
+  }
+}
+
+//inserts a booking keeping the list sorted, to be called with the mutex held
+//returns -1 if it overlaps with another booking
+int insertBooking(Season *season, u32 idUmbrella, u32 user, i16 start, i16 end, int testOnly) {
+  BookingList *list = season->bookingList + idUmbrella;
+  Booking booking = {start, end, user};
+
+  u32 i = findBooking(list, start);
+  if (i < list->count && list->booking[i].start <= end) return -1;
+  if (testOnly) return 0;
+
+  ownBookings(season, list);
+  Booking *array = list->booking;
+  if (list->count == list->capacity) {
+    //moves to the next size class, readers only look at the arrays under the mutex
+    u32 capacity;
+    array = arenaAlloc(&season->arena, list->count + 1, &capacity);
+    memcpy(array, list->booking, list->count * sizeof(Booking));
+    arenaFree(&season->arena, list->booking, list->capacity);
+    list->booking = array;
+    list->capacity = capacity;
+  }
+  if (i < list->count)
+    memmove(array + i + 1, array + i, (list->count - i) * sizeof(Booking));
+  beginWrite(season, idUmbrella);
+  array[i] = booking;
+  list->count++;
+  markDays(season, idUmbrella, start, end, 1);
+  endWrite(season, idUmbrella);
+  notifyChange(season, idUmbrella);
+  indexBooking(season, user, idUmbrella, start, end, 1);
+  return 0;
+}
+
+//drops every booking of the user from the list in a single pass, leaving the index alone;
+//to be called with the mutex held, the removed ones go in out if not NULL
+static int compactBookings(Season *season, u32 idUmbrella, u32 user, UserBooking *out) {
+  BookingList *list = season->bookingList + idUmbrella;
+  int removed = 0;
+  ownBookings(season, list);
+  beginWrite(season, idUmbrella);
+  Booking *array = list->booking;
+  u32 kept = 0;
+  for (u32 i = 0; i < list->count; i++) {
+    if (array[i].user == user) {
+      markDays(season, idUmbrella, array[i].start, array[i].end, 0);
+      if (out) {
+        UserBooking booking = {idUmbrella, array[i].start, array[i].end};
+        out[removed] = booking;
+      }
+      removed++;
+    } else {
+      array[kept++] = array[i];
+    }
+  }
+  list->count = kept;
+  endWrite(season, idUmbrella);
+  if (removed) notifyChange(season, idUmbrella);
+  return removed;
+}
+
+//removes every booking of the user, to be called with the mutex held
+//returns how many bookings were removed
+int deleteBookings(Season *season, u32 idUmbrella, u32 user) {
+  //once indexed, only the bookings of the user are visited
+  if (season->users) {
+    UserBooking *booking;
+    int count = userBookings(season, user, &booking);
+    int removed = 0;
+    for (int i = 0; i < count; i++)
+      if (booking[i].umbrella == idUmbrella && !deleteBooking(season, idUmbrella, user, booking[i].start))
+        removed++;
+    free(booking);
+    return removed;
+  }
+  return compactBookings(season, idUmbrella, user, NULL);
+}
+
+int deleteBooking(Season *season, u32 idUmbrella, u32 user, i16 start) {
+  BookingList *list = season->bookingList + idUmbrella;
+  u32 i = findBooking(list, start);
+  if (i >= list->count || list->booking[i].start != start || list->booking[i].user != user)
+    return -1;
+
+  ownBookings(season, list);
+  beginWrite(season, idUmbrella);
+  markDays(season, idUmbrella, start, list->booking[i].end, 0);
+  if (i < list->count - 1)
+    memmove(list->booking + i, list->booking + i + 1, (list->count - i - 1) * sizeof(Booking));
+  list->count--;
+  endWrite(season, idUmbrella);
+  notifyChange(season, idUmbrella);
+  indexBooking(season, user, idUmbrella, start, 0, 0);
+  return 0;
+}
+
+//applies a log record newer than its list, to be called with the list mutex held
+static void applyRecord(Season *season, WalRecord *rec) {
+  if (rec->type == WAL_GROUP) return;
+  BookingList *list = season->bookingList + rec->umbrella;
+  if (rec->lsn <= list->lsn) return;
+  if (rec->type == WAL_ADD) {
+    insertBooking(season, rec->umbrella, rec->user, rec->start, rec->end, 0);
+  } else if (rec->type == WAL_REMOVE) {
+    deleteBookings(season, rec->umbrella, rec->user);
+  }
+  list->lsn = rec->lsn;
+  season->dirty[rec->umbrella] = 1;
+}
+
+//applies the records of the segments starting from firstSeq that are newer than the lists,
+//returns the number of the last segment found
+u32 replayWal(Season *season, u32 firstSeq, u64 *lastLsn) {
+  char path[WAL_PATH];
+  u32 seq;
+  for (seq = firstSeq; ; seq++) {
+    walPath(&season->wal, path, sizeof(path), seq);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) break;
+
+    WalRecord rec;
+    u64 prev = 0;
+    struct stat st;
+    fstat(fileno(fp), &st);
+    //a torn record (or group) at the tail ends the segment
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      if (rec.lsn <= prev || rec.umbrella >= season->nUmbrella) break;
+      if (rec.type == WAL_GROUP && ftell(fp) + rec.user * sizeof(rec) > st.st_size) break;
+      prev = rec.lsn;
+      if (rec.lsn > *lastLsn) *lastLsn = rec.lsn;
+      applyRecord(season, &rec);
+    }
+    fclose(fp);
+  }
+  return seq - 1;
+}
+
+u32 readBookingList(Season *season, u32 *walSeq, u64 *lastLsn) {
+  if (loadSnapshot(season, walSeq, lastLsn))
+  {
+    char path[256];
+    seasonPath(season, path, sizeof(path), savefile);
+    importBookingList(season, path, walSeq, lastLsn);
+  }
+  loadDelta(season, walSeq, lastLsn);
+  return replayWal(season, *walSeq, lastLsn);
+}
+
+void loadBookingList(Season *season) {
+  u32 walSeq = 1;
+  u64 lastLsn = 0;
+  //a new segment is always started, the last one may end with a torn record
+  u32 lastSeq = readBookingList(season, &walSeq, &lastLsn);
+  if (lastSeq >= walSeq) mprintf("Log applicato fino al record %llu.\n", (unsigned long long)lastLsn);
+  season->wal.firstSeq = walSeq;
+  initWal(&season->wal, lastSeq + 1, lastLsn + 1);
+  buildUserIndex(season);
+}
+
+void importBookingList(Season *season, const char *path, u32 *walSeq, u64 *lastLsn) {
+  FILE *fp;
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    if (errno == ENOENT) {
+      mprintf("Il file 'data' non esiste, creazione di un nuovo database.\n");
+      return;
+    } else {
+      exitError(errno, "Impossibile aprire il file 'data'.");
+    }
+  }
+  char *line = NULL;
+  size_t bufSize = 0;
+  //files without the header are from before the log, with no lsn
+  int version = 1;
+  int c = fgetc(fp);
+  ungetc(c, fp);
+  if (c == '#') {
+    if (getline(&line, &bufSize, fp) == -1 ||
+        sscanf(line, "#beach %d %u", &version, walSeq) != 2)
+      exitError(-1, "invalid header.");
+  }
+
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    if (getline(&line, &bufSize, fp) == -1) exitError(i, "this line is missing.");
+
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+
+    char *tokstate;
+    char *countToken = strtok_r(line, " ", &tokstate);
+    //user and day of the old locks, ignored
+    strtok_r(NULL, " ", &tokstate);
+    char *dayToken = strtok_r(NULL, " ", &tokstate);
+    if (dayToken == NULL) exitError(i, "error on parsing this line of file.");
+    if (version > 1) {
+      char *lsnToken = strtok_r(NULL, " ", &tokstate);
+      if (lsnToken == NULL) exitError(i, "error on parsing this line of file.");
+      list->lsn = strtoull(lsnToken, NULL, 10);
+      if (list->lsn > *lastLsn) *lastLsn = list->lsn;
+    }
+    u32 count = atoi(countToken);
+    freeBookings(season, list);
+    list->booking = arenaAlloc(&season->arena, count, &list->capacity);
+    list->count = count;
+
+    for (u32 j = 0; j < count; j++) {
+      char *user = strtok_r(NULL, " ", &tokstate);
+      char *start = strtok_r(NULL, " ", &tokstate);
+      char *end = strtok_r(NULL, " ", &tokstate);
+      if (end == NULL) exitError(i, "too few arguments on this line.");
+      Booking *booking = list->booking + j;
+      booking->user = atoi(user);
+      booking->start = atoi(start);
+      booking->end = atoi(end);
+      if (booking->start > booking->end) exitError(i, "invalid booking.");
+      markDays(season, i, booking->start, booking->end, 1);
+    }
+    if (strtok_r(NULL, " ", &tokstate) != NULL) exitError(i, " too many arguments on this line.");
+    pthread_mutex_unlock(listMutex(season, list));
+  }
+  fclose(fp);
+  free(line);
+  mprintf("Database caricato in memoria.\n");
+}
+
+void initWal(Wal *wal, u32 seq, u64 nextLsn) {
+  char path[WAL_PATH];
+  wal->seq = seq;
+  walPath(wal, path, sizeof(path), seq);
+  CHECK(wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644));
+  wal->nextLsn = nextLsn;
+  wal->durableLsn = nextLsn;
+  wal->rotate = 0;
+  wal->stop = 0;
+  wal->pending = (String){0};
+  pthread_mutex_init(&wal->mutex, NULL);
+  pthread_cond_init(&wal->flushCond, NULL);
+  pthread_cond_init(&wal->syncCond, NULL);
+  pthread_create(&wal->thread, NULL, walLoop, wal);
+}
+
+//lsn of the last record appended by the current thread and not yet committed
+static __thread u64 walPending;
+
+static void catData(String *out, const void *data, size_t len) {
+  if (out->len + len > out->size) {
+    out->size = 2 * out->size + len;
+    out->str = realloc(out->str, out->size);
+  }
+  memcpy(out->str + out->len, data, len);
+  out->len += len;
+}
+
+static void catRecord(String *out, int type, u64 lsn, u32 umbrella, u32 user, i16 start, i16 end) {
+  WalRecord rec = {0};
+  rec.lsn = lsn;
+  rec.umbrella = umbrella;
+  rec.user = user;
+  rec.start = start;
+  rec.end = end;
+  rec.type = type;
+  catData(out, &rec, sizeof(rec));
+}
+
+//adds a record to the pending batch, to be called with the log mutex held
+static u64 walPush(Wal *wal, int type, u32 umbrella, u32 user, i16 start, i16 end) {
+  u64 lsn = wal->nextLsn++;
+  catRecord(&wal->pending, type, lsn, umbrella, user, start, end);
+  return lsn;
+}
+
+u64 walAppend(Wal *wal, int type, u32 umbrella, u32 user, i16 start, i16 end) {
+  pthread_mutex_lock(&wal->mutex);
+  u64 lsn = walPush(wal, type, umbrella, user, start, end);
+  pthread_cond_signal(&wal->flushCond);
+  pthread_mutex_unlock(&wal->mutex);
+
+  walPending = lsn;
+  return lsn;
+}
+
+u64 walAppendGroup(Wal *wal, u32 user, u32 *ids, int n, i16 start, i16 end) {
+  pthread_mutex_lock(&wal->mutex);
+  walPush(wal, WAL_GROUP, 0, n, 0, 0);
+  u64 first = wal->nextLsn;
+  for (int i = 0; i < n; i++)
+    walPending = walPush(wal, WAL_ADD, ids[i], user, start, end);
+  pthread_cond_signal(&wal->flushCond);
+  pthread_mutex_unlock(&wal->mutex);
+  return first;
+}
+
+void walCommit(Wal *wal) {
+  if (!walPending) return;
+  pthread_mutex_lock(&wal->mutex);
+  while (wal->durableLsn <= walPending)
+    pthread_cond_wait(&wal->syncCond, &wal->mutex);
+  pthread_mutex_unlock(&wal->mutex);
+  walPending = 0;
+}
+
+u32 walRotate(Wal *wal) {
+  pthread_mutex_lock(&wal->mutex);
+  wal->rotate = 1;
+  pthread_cond_signal(&wal->flushCond);
+  while (wal->rotate)
+    pthread_cond_wait(&wal->syncCond, &wal->mutex);
+  u32 seq = wal->seq;
+  pthread_mutex_unlock(&wal->mutex);
+  return seq;
+}
+
+void *walLoop(void *arg) {
+  Wal *wal = (Wal *)arg;
+  String batch = {0};
+  pthread_mutex_lock(&wal->mutex);
+  for (;;) {
+    while (wal->pending.len == 0 && !wal->rotate && !wal->stop)
+      pthread_cond_wait(&wal->flushCond, &wal->mutex);
+    //stopping, and everything appended is already on disk
+    if (wal->pending.len == 0 && !wal->rotate) break;
+
+    //everything appended while we write and sync goes in the next batch
+    String tmp = batch;
+    batch = wal->pending;
+    wal->pending = tmp;
+    wal->pending.len = 0;
+    u64 upto = wal->nextLsn;
+    int rotate = wal->rotate;
+    pthread_mutex_unlock(&wal->mutex);
+
+    for (size_t done = 0; done < batch.len; ) {
+      ssize_t n = write(wal->fd, batch.str + done, batch.len - done);
+      CHECK(n);
+      done += n;
+    }
+    if (batch.len) CHECK(fdatasync(wal->fd));
+    //the replicas never see a change the primary could lose
+    if (batch.len && wal->replicate) replicate(batch.str, batch.len);
+
+    pthread_mutex_lock(&wal->mutex);
+    if (rotate) {
+      char path[WAL_PATH];
+      close(wal->fd);
+      walPath(wal, path, sizeof(path), ++wal->seq);
+      CHECK(wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644));
+      wal->rotate = 0;
+    }
+    wal->durableLsn = upto;
+    pthread_cond_broadcast(&wal->syncCond);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+  free(batch.str);
+  return NULL;
+}
+
+void stopWal(Wal *wal) {
+  pthread_mutex_lock(&wal->mutex);
+  wal->stop = 1;
+  pthread_cond_signal(&wal->flushCond);
+  pthread_mutex_unlock(&wal->mutex);
+  pthread_join(wal->thread, NULL);
+  close(wal->fd);
+  free(wal->pending.str);
+}
+
+void replicate(const char *data, size_t len) {
+  pthread_mutex_lock(&repl.mutex);
+  for (Follower *f = repl.followers; f; f = f->next) {
+    if (f->dead) continue;
+    if (f->out.len + len > REPL_BACKLOG) {
+      //too far behind, it gets a fresh copy when it reconnects
+      f->dead = 1;
+      shutdown(f->fd, SHUT_RDWR);
+    } else catData(&f->out, data, len);
+    pthread_cond_signal(&f->cond);
+  }
+  pthread_mutex_unlock(&repl.mutex);
+}
+
+static int sendAll(int fd, const char *data, size_t len) {
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = send(fd, data + done, len - done, MSG_NOSIGNAL);
+    if (n < 1) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+//copies the lists of the main beach to a new replica, then streams the log batches
+static void *followerLoop(void *arg) {
+  Follower *f = arg;
+  Season *season = beaches.season[0];
+  pthread_mutex_lock(&repl.mutex);
+  f->next = repl.followers;
+  repl.followers = f;
+  repl.nFollowers++;
+  pthread_mutex_unlock(&repl.mutex);
+
+  //the batches made durable from now on are queued, the older changes are already in
+  //the lists: the replica skips the records it gets twice by the lsn of their list
+  String batch = {0};
+  Booking *copy = NULL;
+  u32 capacity = 0;
+  int failed = 0;
+  for (u32 i = 0; i < season->nUmbrella && !failed; i++) {
+    BookingList *list = season->bookingList + i;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    u32 count = list->count;
+    if (count > capacity) {
+      capacity = count;
+      copy = realloc(copy, capacity * sizeof(Booking));
+    }
+    copyBookings(list, copy);
+    catRecord(&batch, REPL_LIST, list->lsn, i, 0, 0, 0);
+    pthread_mutex_unlock(listMutex(season, list));
+    for (u32 j = 0; j < count; j++)
+      catRecord(&batch, REPL_BOOKING, 0, i, copy[j].user, copy[j].start, copy[j].end);
+    if (batch.len >= 65536 || i == season->nUmbrella - 1) {
+      if (i == season->nUmbrella - 1) catRecord(&batch, REPL_READY, 0, 0, 0, 0, 0);
+      failed = sendAll(f->fd, batch.str, batch.len);
+      batch.len = 0;
+    }
+  }
+  free(copy);
+
+  pthread_mutex_lock(&repl.mutex);
+  while (!failed && !f->dead) {
+    if (f->out.len == 0) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += REPL_KEEPALIVE;
+      if (pthread_cond_timedwait(&f->cond, &repl.mutex, &until) == ETIMEDOUT && f->out.len == 0)
+        catRecord(&f->out, REPL_HEARTBEAT, 0, 0, 0, 0, 0);
+      continue;
+    }
+    String tmp = batch;
+    batch = f->out;
+    f->out = tmp;
+    f->out.len = 0;
+    pthread_mutex_unlock(&repl.mutex);
+    failed = sendAll(f->fd, batch.str, batch.len);
+    pthread_mutex_lock(&repl.mutex);
+  }
+  for (Follower **p = &repl.followers; *p; p = &(*p)->next) {
+    if (*p != f) continue;
+    *p = f->next;
+    break;
+  }
+  repl.nFollowers--;
+  pthread_mutex_unlock(&repl.mutex);
+
+  mprintf("Replica disconnessa.\n");
+  close(f->fd);
+  pthread_cond_destroy(&f->cond);
+  free(f->out.str);
+  free(batch.str);
+  free(f);
+  return NULL;
+}
+
+void *replicationLoop(void *arg) {
+  struct sockaddr_in sa = {0};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(server->replPort);
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  int msd, opt = 1;
+  CHECK(msd = socket(AF_INET, SOCK_STREAM, 0));
+  setsockopt(msd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+  CHECK(bind(msd, (struct sockaddr *)&sa, sizeof(sa)));
+  listen(msd, 10);
+
+  for (;;) {
+    int csd = accept(msd, NULL, 0);
+    if (csd == -1) continue;
+    Follower *f = calloc(1, sizeof(Follower));
+    f->fd = csd;
+    pthread_cond_init(&f->cond, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, followerLoop, f);
+    pthread_detach(thread);
+    mprintf("Replica connessa.\n");
+  }
+  return NULL;
+}
+
+//empties a list the primary is about to send again, to be called with the mutex held
+static void clearBookings(Season *season, u32 idUmbrella) {
+  BookingList *list = season->bookingList + idUmbrella;
+  while (list->count) {
+    deleteBookings(season, idUmbrella, list->booking[0].user);
+  }
+}
+
+void *replicaLoop(void *arg) {
+  Season *season = arg;
+  struct sockaddr_in sa = {0};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(server->primaryPort);
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+  for (;; sleep(1)) {
+    int fd;
+    CHECK(fd = socket(AF_INET, SOCK_STREAM, 0));
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+      close(fd);
+      continue;
+    }
+    mprintf("Connesso al primario.\n");
+    FILE *fp = fdopen(fd, "r");
+    WalRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      __atomic_store_n(&repl.contact, time(NULL), __ATOMIC_RELAXED);
+      if (rec.type == REPL_HEARTBEAT) continue;
+      if (rec.type == REPL_READY) {
+        __atomic_store_n(&repl.synced, 1, __ATOMIC_RELEASE);
+        mprintf("Replica allineata al record %llu.\n", (unsigned long long)repl.lsn);
+        continue;
+      }
+      if (rec.umbrella >= season->nUmbrella) {
+        logPrint(LOG_ERROR, "il primario ha piu' ombrelloni di questa replica.\n");
+        break;
+      }
+      BookingList *list = season->bookingList + rec.umbrella;
+      statLock(listMutex(season, list), LOCK_BOOKING);
+      if (rec.type == REPL_LIST) {
+        clearBookings(season, rec.umbrella);
+        list->lsn = rec.lsn;
+      } else if (rec.type == REPL_BOOKING) {
+        insertBooking(season, rec.umbrella, rec.user, rec.start, rec.end, 0);
+      } else {
+        applyRecord(season, &rec);
+      }
+      pthread_mutex_unlock(listMutex(season, list));
+      if (rec.lsn > repl.lsn) __atomic_store_n(&repl.lsn, rec.lsn, __ATOMIC_RELAXED);
+    }
+    fclose(fp);
+    __atomic_store_n(&repl.synced, 0, __ATOMIC_RELEASE);
+    logPrint(LOG_WARN, "Connessione al primario persa.\n");
+  }
+  return NULL;
+}
+
+//a replica answers only once in sync and while it hears from the primary
+static int replicaStale(Season *season) {
+  if (!season->readOnly) return 0;
+  time_t contact = __atomic_load_n(&repl.contact, __ATOMIC_RELAXED);
+  return !__atomic_load_n(&repl.synced, __ATOMIC_ACQUIRE) || time(NULL) - contact > server->maxLag;
+}
+
+//logs a change of the list, to be called with its mutex held; the list is marked
+//first, so a checkpoint rotating away the record's segment always copies the list
+static void logChange(Season *season, u32 idUmbrella, int type, u32 user, i16 start, i16 end) {
+  BookingList *list = season->bookingList + idUmbrella;
+  __atomic_store_n(season->dirty + idUmbrella, 1, __ATOMIC_RELEASE);
+  list->lsn = walAppend(&season->wal, type, idUmbrella, user, start, end);
+}
+
+static void freeLease(Leases *leases, Lease *lease) {
+  Lease **p = leases->umbrella + lease->umbrella;
+  while (*p != lease) p = &(*p)->next;
+  *p = lease->next;
+  if (lease->timerPrev) lease->timerPrev->timerNext = lease->timerNext;
+  else leases->wheel[lease->expires % LEASE_SLOTS] = lease->timerNext;
+  if (lease->timerNext) lease->timerNext->timerPrev = lease->timerPrev;
+  free(lease);
+}
+
+//frees the leases expired up to now, to be called with the lease mutex held;
+//the ones left are all valid
+static void expireLeases(Leases *leases, time_t now) {
+  if (now - leases->wheelTime > LEASE_SLOTS) leases->wheelTime = now - LEASE_SLOTS;
+  while (leases->wheelTime < now) {
+    Lease **slot = leases->wheel + ++leases->wheelTime % LEASE_SLOTS;
+    while (*slot) freeLease(leases, *slot);
+  }
+}
+
+//returns -1 if another user holds a lease on some of the days, frees the one of the
+//user if release is set
+static int checkLease(Season *season, u32 user, u32 idUmbrella, int start, int end, int release) {
+  Leases *leases = &season->leases;
+  statLock(&leases->mutex, LOCK_LEASE);
+  expireLeases(leases, time(NULL));
+  Lease *mine = NULL;
+  int result = 0;
+  for (Lease *lease = leases->umbrella[idUmbrella]; lease; lease = lease->next) {
+    if (lease->user == user) mine = lease;
+    else if (lease->start <= end && start <= lease->end) result = -1;
+  }
+  if (!result && release && mine) freeLease(leases, mine);
+  pthread_mutex_unlock(&leases->mutex);
+  return result;
+}
+
+int takeLease(Season *season, u32 user, u32 idUmbrella, int start, int end, int checkBookings) {
+  if (idUmbrella >= season->nUmbrella) return -1;
+  if (start > end || start < season->start || end > season->end) return -1;
+  BookingList *list = season->bookingList + idUmbrella;
+  Leases *leases = &season->leases;
+  statLock(listMutex(season, list), LOCK_BOOKING);
+  int result = checkBookings ? insertBooking(season, idUmbrella, user, start, end, 1) : 0;
+  if (!result) result = checkLease(season, user, idUmbrella, start, end, 1);
+  if (!result) {
+    Lease *lease = malloc(sizeof(Lease));
+    lease->user = user;
+    lease->umbrella = idUmbrella;
+    lease->start = start;
+    lease->end = end;
+    statLock(&leases->mutex, LOCK_LEASE);
+    lease->expires = leases->wheelTime + season->leaseTime;
+    lease->next = leases->umbrella[idUmbrella];
+    leases->umbrella[idUmbrella] = lease;
+    Lease **slot = leases->wheel + lease->expires % LEASE_SLOTS;
+    lease->timerPrev = NULL;
+    lease->timerNext = *slot;
+    if (*slot) (*slot)->timerPrev = lease;
+    *slot = lease;
+    pthread_mutex_unlock(&leases->mutex);
+  }
+  pthread_mutex_unlock(listMutex(season, list));
+  return result;
+}
+
+void releaseLease(Season *season, u32 user, u32 idUmbrella) {
+  if (idUmbrella >= season->nUmbrella) return;
+  Leases *leases = &season->leases;
+  statLock(&leases->mutex, LOCK_LEASE);
+  for (Lease *lease = leases->umbrella[idUmbrella]; lease; lease = lease->next) {
+    if (lease->user != user) continue;
+    freeLease(leases, lease);
+    break;
+  }
+  pthread_mutex_unlock(&leases->mutex);
+}
+
+int removeBooking(Season *season, u32 user, u32 idUmbrella) {
+  if (idUmbrella >= season->nUmbrella) return -1;
+
+  BookingList *list = season->bookingList + idUmbrella;
+  statLock(listMutex(season, list), LOCK_BOOKING);
+  if (deleteBookings(season, idUmbrella, user))
+    logChange(season, idUmbrella, WAL_REMOVE, user, 0, 0);
+  pthread_mutex_unlock(listMutex(season, list));
+  return 0;
+}
+
+static int compareUserBookings(const void *a, const void *b) {
+  const UserBooking *x = a, *y = b;
+  if (x->start != y->start) return x->start - y->start;
+  return x->umbrella < y->umbrella ? -1 : x->umbrella > y->umbrella;
+}
+
+int _testSetBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end, int testOnly) {
   if (idUmbrella >= season->nUmbrella) return -1;
   if (start > end)                     return -1;
   if (start < season->start)           return -1;
   if (end > season->end)               return -1;
 
-  BookingList *list = season->bookingList + idUmbrella;
-  pthread_mutex_lock(&list->mutex);
-  Booking *array = list->booking;
+  BookingList *list = season->bookingList + idUmbrella;
+  statLock(listMutex(season, list), LOCK_BOOKING);
+  //the days leased by another user can't be booked, the lease of the user ends here
+  int result = checkLease(season, user, idUmbrella, start, end, !testOnly);
+  if (!result) result = insertBooking(season, idUmbrella, user, start, end, testOnly);
+  if (!result && !testOnly)
+    logChange(season, idUmbrella, WAL_ADD, user, start, end);
+  pthread_mutex_unlock(listMutex(season, list));
+  return result;
+}
+
+static int compareIds(const void *a, const void *b) {
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+int addGroupBooking(Season *season, u32 user, u32 *ids, int n, i16 start, i16 end) {
+  if (n < 1)                 return -1;
+  if (start > end)           return -1;
+  if (start < season->start) return -1;
+  if (end > season->end)     return -1;
+
+  //the lists are always locked in ascending order, so groups can't deadlock
+  qsort(ids, n, sizeof(u32), compareIds);
+  for (int i = 0; i < n; i++) {
+    if (ids[i] >= season->nUmbrella) return -1;
+    if (i > 0 && ids[i] == ids[i-1]) return -1;
+  }
+  for (int i = 0; i < n; i++)
+    statLock(&season->lock[ids[i]].mutex, LOCK_BOOKING);
+
+  int result = 0;
+  for (int i = 0; i < n && !result; i++)
+    result = checkLease(season, user, ids[i], start, end, 0) ||
+        insertBooking(season, ids[i], user, start, end, 1);
+  if (!result) {
+    for (int i = 0; i < n; i++) {
+      releaseLease(season, user, ids[i]);
+      __atomic_store_n(season->dirty + ids[i], 1, __ATOMIC_RELEASE);
+    }
+    u64 lsn = walAppendGroup(&season->wal, user, ids, n, start, end);
+    for (int i = 0; i < n; i++) {
+      BookingList *list = season->bookingList + ids[i];
+      insertBooking(season, ids[i], user, start, end, 0);
+      list->lsn = lsn + i;
+    }
+  }
+
+  for (int i = n - 1; i >= 0; i--)
+    pthread_mutex_unlock(&season->lock[ids[i]].mutex);
+  return result;
+}
+
+static int compareUmbrellas(const void *a, const void *b) {
+  const UserBooking *x = a, *y = b;
+  if (x->umbrella != y->umbrella) return x->umbrella < y->umbrella ? -1 : 1;
+  return x->start - y->start;
+}
+
+//drops the removed bookings, sorted by umbrella and start, from the index of the user
+//in one pass; each one takes a single entry, a rebooking made meanwhile keeps its own
+static void unindexBookings(Season *season, u32 user, UserBooking *removed, int n) {
+  if (!season->users || !n) return;
+  u8 *taken = calloc(n, 1);
+  UserStripe *stripe = season->users + hashUser(user) % USER_STRIPES;
+  pthread_mutex_lock(&stripe->mutex);
+  UserEntry *entry = findUser(stripe, user, 0);
+  u32 kept = 0;
+  for (u32 i = 0; entry && i < entry->count; i++) {
+    UserBooking *hit = bsearch(entry->booking + i, removed, n, sizeof(UserBooking), compareUmbrellas);
+    if (hit && !taken[hit - removed]) taken[hit - removed] = 1;
+    else entry->booking[kept++] = entry->booking[i];
+  }
+  if (entry) entry->count = kept;
+  pthread_mutex_unlock(&stripe->mutex);
+  free(taken);
+}
+
+int removeAllBookings(Season *season, u32 user) {
+  UserBooking *booking;
+  int count = userBookings(season, user, &booking);
+  //one snapshot of the index says which lists to visit; each is locked, compacted
+  //and logged once, like a cancel of that umbrella
+  qsort(booking, count, sizeof(UserBooking), compareUmbrellas);
+  UserBooking *removed = NULL;
+  int nRemoved = 0, freed = 0;
+  for (int i = 0; i < count; i++) {
+    if (i > 0 && booking[i].umbrella == booking[i-1].umbrella) continue;
+    u32 id = booking[i].umbrella;
+    BookingList *list = season->bookingList + id;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    if (list->count) removed = realloc(removed, (nRemoved + list->count) * sizeof(UserBooking));
+    int n = compactBookings(season, id, user, removed + nRemoved);
+    if (n) {
+      logChange(season, id, WAL_REMOVE, user, 0, 0);
+      nRemoved += n;
+      freed++;
+    }
+    pthread_mutex_unlock(listMutex(season, list));
+  }
+  free(booking);
+  //the lists are visited in order and keep their bookings by start, so removed is sorted
+  unindexBookings(season, user, removed, nRemoved);
+  free(removed);
+  return freed;
+}
+
+int parseBulkRow(Season *season, char **toks, int nToks, BulkRow *row) {
+  if (nToks != 4) return -1;
+  char *end;
+  long id = strtol(toks[0], &end, 10);
+  if (*end || end == toks[0] || id < 0 || id >= season->nUmbrella) return -1;
+  row->umbrella = id;
+  row->user = strtoul(toks[1], &end, 10);
+  if (*end || end == toks[1]) return -1;
+  row->start = parseDate(toks[2], season->year);
+  row->end = parseDate(toks[3], season->year);
+  if (row->start > row->end || row->start < season->start || row->end > season->end) return -1;
+  return 0;
+}
+
+//to be called with the mutex held
+static int hasBooking(BookingList *list, u32 user, i16 start, i16 end) {
+  u32 i = findBooking(list, start);
+  Booking *booking = list->booking + i;
+  return i < list->count && booking->start == start && booking->end == end && booking->user == user;
+}
+
+static int compareRows(const void *a, const void *b) {
+  const BulkRow *x = a, *y = b;
+  if (x->umbrella != y->umbrella) return x->umbrella < y->umbrella ? -1 : 1;
+  return x->start - y->start;
+}
+
+void bulkBookings(Season *season, BulkRow *rows, int n) {
+  //in order the bookings of a list are mostly appended to its array
+  qsort(rows, n, sizeof(BulkRow), compareRows);
+  for (int i = 0; i < n; ) {
+    u32 id = rows[i].umbrella;
+    BookingList *list = season->bookingList + id;
+    statLock(listMutex(season, list), LOCK_BOOKING);
+    for (; i < n && rows[i].umbrella == id; i++) {
+      BulkRow *row = rows + i;
+      if (!checkLease(season, row->user, id, row->start, row->end, 0) &&
+          !insertBooking(season, id, row->user, row->start, row->end, 0)) {
+        logChange(season, id, WAL_ADD, row->user, row->start, row->end);
+        row->status = BULK_ADDED;
+      } else if (hasBooking(list, row->user, row->start, row->end)) {
+        row->status = BULK_PRESENT;
+      } else {
+        row->status = BULK_REJECTED;
+      }
+    }
+    pthread_mutex_unlock(listMutex(season, list));
+  }
+}
+
+int findAdjacent(Season *season, int row, int n, int start, int end) {
+  if (row < 0 || row >= season->nRows || n < 1) return -1;
+  u32 first = row * season->nCols;
+  u32 last = first + season->nCols;
+  u64 avail[BITSET_WORDS(last)];
+  if (findAvailable(season, start, end, first, last, avail) < n) return -1;
+
+  int run = 0;
+  for (u32 i = first; i < last; i++) {
+    if (avail[i / 64] & (1ULL << (i % 64))) {
+      if (++run == n) return i - n + 1;
+    } else run = 0;
+  }
+  return -1;
+}
+
+//returns 0 if the booking is successful
+int addBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end) {
+  return _testSetBooking(season, user, idUmbrella, start, end, 0);
+}
+
+//mask of the bits of word w falling between start and end
+static u64 dayMask(int w, int start, int end) {
+  int lo = start - w * 64;
+  int hi = end - w * 64;
+  if (lo < 0) lo = 0;
+  if (hi > 63) hi = 63;
+  if (lo > hi) return 0;
+  return (~0ULL >> (63 - hi)) & (~0ULL << lo);
+}
+
+//writers hold the umbrella mutex, the stores are atomic for the lock-free readers;
+//a word of the day bitsets belongs to 64 umbrellas, so it is changed with atomic ops
+void markDays(Season *season, u32 idUmbrella, int start, int end, int value) {
+  u64 *days = season->days[idUmbrella];
+  if (start < 0) start = 0;
+  if (end >= SEASON_DAYS) end = SEASON_DAYS - 1;
+  for (int w = start / 64; w <= end / 64 && w < DAY_WORDS; w++) {
+    u64 mask = dayMask(w, start, end);
+    u64 word = value ? days[w] | mask : days[w] & ~mask;
+    __atomic_store_n(days + w, word, __ATOMIC_RELAXED);
+  }
+
+  //the bitsets only cover the season
+  if (start < season->start) start = season->start;
+  if (end > season->end) end = season->end;
+  if (start > end) return;
+  u64 bit = 1ULL << (idUmbrella % 64);
+  u64 *p = season->byDay + (size_t)(start - season->start) * season->dayWords + idUmbrella / 64;
+  for (int day = start; day <= end; day++, p += season->dayWords) {
+    if (value) __atomic_fetch_or(p, bit, __ATOMIC_RELAXED);
+    else __atomic_fetch_and(p, ~bit, __ATOMIC_RELAXED);
+  }
+}
+
+//reads the masked occupancy of an umbrella, retrying while a writer is active
+static u64 readBusy(Season *season, u32 id, int w0, int w1, const u64 *mask) {
+  u32 *seq = season->version + id;
+  u64 *days = season->days[id];
+  for (;;) {
+    u32 version = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (version & 1) continue;
+    u64 busy = 0;
+    for (int w = w0; w <= w1; w++)
+      busy |= __atomic_load_n(days + w, __ATOMIC_RELAXED) & mask[w];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == version) return busy;
+  }
+}
+
+//keeps only the bits of [first, last) in the words of the bitset from first on,
+//returns how many are left
+static int maskRange(u64 *bits, u32 first, u32 last) {
+  int count = 0;
+  for (u32 w = first / 64; w < BITSET_WORDS(last); w++) {
+    if (w == first / 64) bits[w] &= ~0ULL << (first % 64);
+    if (w == (last - 1) / 64 && last % 64) bits[w] &= ~0ULL >> (64 - last % 64);
+    count += __builtin_popcountll(bits[w]);
+  }
+  return count;
+}
+
+//no umbrella lock is taken, addBooking still validates the range under the lock
+int findAvailable(Season *season, int start, int end, u32 first, u32 last, u64 *avail) {
+  memset(avail, 0, BITSET_WORDS(last) * sizeof(u64));
+  if (start > end || start < season->start || end > season->end) return 0;
+
+  //today is read from its cache, unless a rollover reuses the set meanwhile
+  DaySet *set = __atomic_load_n(&season->today.set, __ATOMIC_ACQUIRE);
+  if (start == end && set && start == __atomic_load_n(&set->day, __ATOMIC_ACQUIRE)) {
+    for (u32 w = first / 64; w < BITSET_WORDS(last); w++)
+      avail[w] = __atomic_load_n(set->free + w, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&set->day, __ATOMIC_RELAXED) == start) return maskRange(avail, first, last);
+    memset(avail, 0, BITSET_WORDS(last) * sizeof(u64));
+  }
+
+  //64 umbrellas per word: the bitsets of the days are ORed in a row at a time, then
+  //what is left unbooked is free over the whole range
+  u32 w0 = first / 64, w1 = BITSET_WORDS(last);
+  const u64 *row = season->byDay + (size_t)(start - season->start) * season->dayWords;
+  for (int day = start; day <= end; day++, row += season->dayWords)
+    for (u32 w = w0; w < w1; w++) avail[w] |= __atomic_load_n(row + w, __ATOMIC_RELAXED);
+  for (u32 w = w0; w < w1; w++) avail[w] = ~avail[w];
+  return maskRange(avail, first, last);
+}
+
+int swrite(int socket, char *text) {
+  int size = strlen(text) + 1;
+  return write(socket, text, size);
+}
+
+static const char digitPairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+char *formatUint(char *p, u32 value) {
+  char tmp[10];
+  char *q = tmp + sizeof(tmp);
+  while (value >= 100) {
+    q -= 2;
+    memcpy(q, digitPairs + value % 100 * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    q -= 2;
+    memcpy(q, digitPairs + value * 2, 2);
+  } else {
+    *--q = '0' + value;
+  }
+  size_t n = tmp + sizeof(tmp) - q;
+  memcpy(p, q, n);
+  return p + n;
+}
+
+char *formatIds(char *p, u64 *bits, u32 first, u32 last) {
+  for (u32 w = first / 64; w < BITSET_WORDS(last); w++) {
+    for (u64 word = bits[w]; word; word &= word - 1) {
+      u32 id = w * 64 + __builtin_ctzll(word);
+      if (id < first || id >= last) continue;
+      *p++ = ' ';
+      p = formatUint(p, id);
+    }
+  }
+  return p;
+}
+
+size_t idsSize(u32 first, u32 last) {
+  size_t digits = 1;
+  for (u32 n = last; n >= 10; n /= 10) digits++;
+  return (size_t)(last - first) * (digits + 1);
+}
+
+int splitToks(char *line, char *toks[], int maxToks) {
+  static const char sep[] = " \n\r";
+  char *tokstate;
+  int nToks = 0;
+  toks[0] = strtok_r(line, sep, &tokstate);
+  while(toks[nToks]) {
+    nToks++;
+    if (nToks >= maxToks) break;
+    toks[nToks] = strtok_r(NULL, sep, &tokstate);
+  }
+  return nToks;
+}
+
+int fillInput(Connection *conn) {
+  for (;;) {
+    u32 used = conn->inHead - conn->inTail;
+    if (used == IN_SIZE) return 0;
+    //the free space of the ring is at most two pieces
+    u32 head = conn->inHead % IN_SIZE;
+    u32 tail = conn->inTail % IN_SIZE;
+    struct iovec iov[2];
+    int nIov = 1;
+    iov[0].iov_base = conn->in + head;
+    if (head >= tail) {
+      iov[0].iov_len = IN_SIZE - head;
+      iov[1].iov_base = conn->in;
+      iov[1].iov_len = tail;
+      nIov = tail ? 2 : 1;
+    } else {
+      iov[0].iov_len = tail - head;
+    }
+    ssize_t n = readv(conn->csd, iov, nIov);
+    if (n > 0) {
+      conn->inHead += n;
+      threadStats()->bytesIn += n;
+    }
+    else if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+    else {
+      conn->eof = 1;
+      return -1;
+    }
+  }
+}
+
+int hasCommand(Connection *conn) {
+  if (conn->binary) return conn->inHead - conn->inTail >= sizeof(BinRequest);
+  for (u32 i = conn->inTail; i != conn->inHead; i++) {
+    char c = conn->in[i % IN_SIZE];
+    if (c == '\n' || c == 0) return 1;
+  }
+  return conn->inHead - conn->inTail == IN_SIZE ||
+         (conn->eof && conn->inHead != conn->inTail);
+}
+
+int nextCommand(Connection *conn, char *line) {
+  if (conn->binary) {
+    if (conn->inHead - conn->inTail < sizeof(BinRequest)) return 0;
+    for (u32 i = 0; i < sizeof(BinRequest); i++)
+      line[i] = conn->in[(conn->inTail + i) % IN_SIZE];
+    conn->inTail += sizeof(BinRequest);
+    return 1;
+  }
+  for (;;) {
+    u32 end;
+    for (end = conn->inTail; end != conn->inHead; end++) {
+      char c = conn->in[end % IN_SIZE];
+      if (c == '\n' || c == 0) break;
+    }
+    u32 len = end - conn->inTail;
+    if (end == conn->inHead) {
+      //the last command of a closed peer may come without terminator
+      if (len == IN_SIZE) {
+        conn->inTail = conn->inHead;
+        conn->discard = 1;
+        return -1;
+      }
+      if (!conn->eof || len == 0) return 0;
+    }
+    for (u32 i = 0; i < len; i++) line[i] = conn->in[(conn->inTail + i) % IN_SIZE];
+    line[len] = 0;
+    conn->inTail = end == conn->inHead ? end : end + 1;
+    if (!conn->discard) return 1;
+    conn->discard = 0;
+  }
+}
+
+char *outReserve(Connection *conn, size_t len) {
+  Output *out = &conn->out;
+  if (out->len + len > out->size) {
+    //what the socket already took makes room first
+    if (out->sent) {
+      memmove(out->buf, out->buf + out->sent, out->len - out->sent);
+      out->len -= out->sent;
+      out->sent = 0;
+    }
+    u32 size = out->size ? out->size : OUT_SIZE;
+    while (out->len + len > size) size *= 2;
+    if (size != out->size) {
+      out->buf = realloc(out->buf, size);
+      out->size = size;
+    }
+  }
+  return out->buf + out->len;
+}
+
+void replyData(Connection *conn, void *data, size_t len) {
+  memcpy(outReserve(conn, len), data, len);
+  conn->out.len += len;
+}
+
+void reply(Connection *conn, char *text) {
+  replyData(conn, text, strlen(text) + 1);
+}
+
+void replyOwned(Connection *conn, char *text) {
+  replyData(conn, text, strlen(text) + 1);
+  free(text);
+}
+
+int writeOutput(Connection *conn) {
+  Output *out = &conn->out;
+  while (out->sent < out->len) {
+    ssize_t n = write(conn->csd, out->buf + out->sent, out->len - out->sent);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 1;
+      out->len = out->sent = 0;
+      return -1;
+    }
+    threadStats()->bytesOut += n;
+    out->sent += n;
+  }
+  out->len = out->sent = 0;
+  return 0;
+}
+
+void flushReplies(Connection *conn) {
+  if (conn->out.len == conn->out.sent) return;
+  //no reply leaves before the changes it acknowledges are durable
+  walCommit(&conn->season->wal);
+  //a full socket is left to the reactor, which waits for it to drain
+  writeOutput(conn);
+}
+
+int processInput(Connection *conn) {
+  //aligned for the binary requests
+  union { char line[IN_SIZE + 1]; BinRequest req; } buf;
+  char *line = buf.line;
+  int result, full = 0;
+  while ((result = nextCommand(conn, line))) {
+    if (result == -1) {
+      reply(conn, "toolong");
+      continue;
+    }
+    u64 start = nowUsec();
+    int cmd;
+    if (conn->binary) {
+      BinRequest *req = (BinRequest *)line;
+      cmd = req->op >= BIN_LOGIN && req->op <= BIN_LOGOUT ?
+          CMD_BIN_LOGIN + req->op - BIN_LOGIN : CMD_BIN_UNKNOWN;
+      result = handleBinary(conn, req);
+    } else if ((conn->nToks = splitToks(line, conn->toks, MAX_TOKS)) == 0) {
+      continue;
+    } else {
+      cmd = commandIndex(conn, conn->state);
+      result = handleCommand(conn);
+    }
+    histRecord(threadStats()->latency + cmd, nowUsec() - start);
+    if (result == -1) {
+      flushReplies(conn);
+      return -1;
+    }
+    //long pipelines are sent as they go, until the socket is full
+    if (!full && conn->out.len - conn->out.sent >= OUT_FLUSH) {
+      flushReplies(conn);
+      full = conn->out.len != 0;
+    }
+  }
+  sendWatch(conn);
+  flushReplies(conn);
+  return conn->eof ? -1 : 0;
+}
+
+char *cmdNames[N_CMDS] = {
+  "login", "book id", "book dates",
+  "book", "bookgroup", "findrow", "available", "availrow", "cancel",
+  "logout", "save", "export", "today", "start", "end", "help",
+  "binary", "stats", "mybookings", "use", "beaches", "load", "unload",
+  "watch", "unwatch", "bulk", "bulk row", "unknown",
+  "bin_login", "bin_available", "bin_availrow", "bin_book", "bin_cancel",
+  "bin_logout", "bin_unknown"
+};
+char *lockNames[N_LOCKS] = {"booking", "connections", "lease"};
+
+int commandIndex(Connection *conn, int state) {
+  char *name = conn->toks[0];
+  if (state == CONN_BOOK) return CMD_BOOK_ID;
+  if (state == CONN_BOOK_DATES) return CMD_BOOK_DATES;
+  if (state == CONN_BULK) return CMD_BULK_ROW;
+  if (!strcmp(name, "binary")) return CMD_BINARY;
+  if (state == CONN_LOGIN) return CMD_LOGIN;
+  for (int i = CMD_BOOK; i < CMD_UNKNOWN; i++)
+    if (!strcmp(name, cmdNames[i])) return i;
+  return CMD_UNKNOWN;
+}
+
+void statsText(String *out, int prometheus) {
+  Stats *total = malloc(sizeof(Stats));
+  mergeStats(total);
+  if (prometheus) {
+    dcatf(out, "# TYPE beach_command_latency_us summary\n");
+    for (int i = 0; i < N_CMDS; i++) {
+      Histogram *h = total->latency + i;
+      if (!h->count) continue;
+      dcatf(out, "beach_command_latency_us{command=\"%s\",quantile=\"0.5\"} %llu\n",
+          cmdNames[i], (unsigned long long)histPercentile(h, 50));
+      dcatf(out, "beach_command_latency_us{command=\"%s\",quantile=\"0.99\"} %llu\n",
+          cmdNames[i], (unsigned long long)histPercentile(h, 99));
+      dcatf(out, "beach_command_latency_us{command=\"%s\",quantile=\"0.999\"} %llu\n",
+          cmdNames[i], (unsigned long long)histPercentile(h, 99.9));
+      dcatf(out, "beach_command_latency_us_sum{command=\"%s\"} %llu\n",
+          cmdNames[i], (unsigned long long)h->sum);
+      dcatf(out, "beach_command_latency_us_count{command=\"%s\"} %llu\n",
+          cmdNames[i], (unsigned long long)h->count);
+    }
+    dcatf(out, "# TYPE beach_lock_wait_us summary\n");
+    for (int i = 0; i < N_LOCKS; i++) {
+      Histogram *h = total->lockWait + i;
+      dcatf(out, "beach_lock_wait_us{lock=\"%s\",quantile=\"0.99\"} %llu\n",
+          lockNames[i], (unsigned long long)histPercentile(h, 99));
+      dcatf(out, "beach_lock_wait_us_sum{lock=\"%s\"} %llu\n",
+          lockNames[i], (unsigned long long)h->sum);
+      dcatf(out, "beach_lock_wait_us_count{lock=\"%s\"} %llu\n",
+          lockNames[i], (unsigned long long)h->count);
+    }
+    dcatf(out, "# TYPE beach_connections gauge\nbeach_connections %u\n", openConnections());
+    dcatf(out, "# TYPE beach_bytes_in_total counter\nbeach_bytes_in_total %llu\n",
+        (unsigned long long)total->bytesIn);
+    dcatf(out, "# TYPE beach_bytes_out_total counter\nbeach_bytes_out_total %llu\n",
+        (unsigned long long)total->bytesOut);
+    dcatf(out, "# TYPE beach_booking_bytes gauge\n# TYPE beach_booking_reserved_bytes gauge\n");
+    pthread_mutex_lock(&beaches.mutex);
+    for (int i = 0; i < beaches.count; i++) {
+      Arena *arena = &beaches.season[i]->arena;
+      dcatf(out, "beach_booking_bytes{beach=\"%s\"} %llu\n", beaches.season[i]->name,
+          (unsigned long long)__atomic_load_n(&arena->used, __ATOMIC_RELAXED));
+      dcatf(out, "beach_booking_reserved_bytes{beach=\"%s\"} %llu\n", beaches.season[i]->name,
+          (unsigned long long)__atomic_load_n(&arena->reserved, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&beaches.mutex);
+    if (server->replPort)
+      dcatf(out, "# TYPE beach_replicas gauge\nbeach_replicas %d\n", repl.nFollowers);
+    if (server->primaryPort) {
+      dcatf(out, "# TYPE beach_replica_lsn gauge\nbeach_replica_lsn %llu\n",
+          (unsigned long long)repl.lsn);
+      dcatf(out, "# TYPE beach_replica_lag_seconds gauge\nbeach_replica_lag_seconds %ld\n",
+          (long)(time(NULL) - repl.contact));
+    }
+  } else {
+    //the label column fits the longest name
+    int width = strlen("command");
+    for (int i = 0; i < N_CMDS; i++)
+      if (strlen(cmdNames[i]) > width) width = strlen(cmdNames[i]);
+    for (int i = 0; i < N_LOCKS; i++) {
+      int len = strlen("wait ") + strlen(lockNames[i]);
+      if (len > width) width = len;
+    }
+    dcatf(out, "stats\n%-*s %9s %7s %7s %7s (us)\n", width, "command", "count", "p50", "p99", "max");
+    for (int i = 0; i < N_CMDS; i++) {
+      Histogram *h = total->latency + i;
+      if (!h->count) continue;
+      dcatf(out, "%-*s %9llu %7llu %7llu %7llu\n", width, cmdNames[i], (unsigned long long)h->count,
+          (unsigned long long)histPercentile(h, 50), (unsigned long long)histPercentile(h, 99),
+          (unsigned long long)h->max);
+    }
+    for (int i = 0; i < N_LOCKS; i++) {
+      Histogram *h = total->lockWait + i;
+      char name[32];
+      snprintf(name, sizeof(name), "wait %s", lockNames[i]);
+      dcatf(out, "%-*s %9llu %7llu %7llu %7llu\n", width, name, (unsigned long long)h->count,
+          (unsigned long long)histPercentile(h, 50), (unsigned long long)histPercentile(h, 99),
+          (unsigned long long)h->max);
+    }
+    dcatf(out, "connections %u\nbytes in %llu out %llu", openConnections(),
+        (unsigned long long)total->bytesIn, (unsigned long long)total->bytesOut);
+    pthread_mutex_lock(&beaches.mutex);
+    for (int i = 0; i < beaches.count; i++) {
+      Arena *arena = &beaches.season[i]->arena;
+      dcatf(out, "\nbookings %s %lluKB of %lluKB", beaches.season[i]->name,
+          (unsigned long long)__atomic_load_n(&arena->used, __ATOMIC_RELAXED) / 1024,
+          (unsigned long long)__atomic_load_n(&arena->reserved, __ATOMIC_RELAXED) / 1024);
+    }
+    pthread_mutex_unlock(&beaches.mutex);
+    if (server->replPort) dcatf(out, "\nreplicas %d", repl.nFollowers);
+    if (server->primaryPort)
+      dcatf(out, "\nreplica lsn %llu lag %lds%s", (unsigned long long)repl.lsn,
+          (long)(time(NULL) - repl.contact), repl.synced ? "" : " syncing");
+  }
+  free(total);
+}
+
+void *metricsLoop(void *arg) {
+  struct sockaddr_in sa = {0};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(server->metricsPort);
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  int msd, opt = 1;
+  CHECK(msd = socket(AF_INET, SOCK_STREAM, 0));
+  setsockopt(msd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+  CHECK(bind(msd, (struct sockaddr *)&sa, sizeof(sa)));
+  listen(msd, 10);
+
+  //a scraper that stops reading or writing holds the endpoint for a second at most
+  struct timeval timeout = {1, 0};
+  for (;;) {
+    int csd = accept(msd, NULL, 0);
+    if (csd == -1) continue;
+    setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    setsockopt(csd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+    char request[1024];
+    read(csd, request, sizeof(request));
+    String body = {};
+    dcatf(&body, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+    statsText(&body, 1);
+    for (size_t done = 0; done < body.len; ) {
+      ssize_t n = write(csd, body.str + done, body.len - done);
+      if (n < 1) break;
+      done += n;
+    }
+    free(body.str);
+    close(csd);
+  }
+  return NULL;
+}
+
+int ckm(char *a, char *b, int n1, int n2) {
+  return !strcmp(a, b) && n1 == n2;
+}
+
+//replies with the list of umbrellas in [first, last) free from start to end
+void sendAvailable(Connection *conn, Season *season, int start, int end, u32 first, u32 last) {
+  u64 avail[BITSET_WORDS(last)];
+  if (!findAvailable(season, start, end, first, last, avail)) {
+    reply(conn, "navailable");
+    return;
+  }
+  char *p = outReserve(conn, sizeof("available") + idsSize(first, last));
+  char *q = formatIds(stpcpy(p, "available"), avail, first, last);
+  *q++ = 0;
+  conn->out.len += q - p;
+}
+
+//copies the cached answer if it is still the one of day, returns 0 if it is stale or
+//was rewritten while copying
+static int copyToday(Connection *conn, DayCache *cache, DayReply *cached, int day) {
+  u32 seq = __atomic_load_n(&cached->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) return 0;
+  u32 len = __atomic_load_n(&cached->len, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&cached->day, __ATOMIC_RELAXED) != day ||
+      __atomic_load_n(&cached->gen, __ATOMIC_RELAXED) != __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE))
+    return 0;
+  memcpy(outReserve(conn, len), cached->text, len);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&cached->seq, __ATOMIC_RELAXED) != seq) return 0;
+  conn->out.len += len;
+  return 1;
+}
+
+//replies to available with no dates with a copy of the cached answer, taken without locks;
+//after a change one worker rebuilds it and the others answer from the free set meanwhile
+void sendToday(Connection *conn, Season *season) {
+  DayCache *cache = &season->today;
+  int day = getCurrentYday();
+  DayReply *cached = __atomic_load_n(&cache->current, __ATOMIC_ACQUIRE);
+  if (cached && copyToday(conn, cache, cached, day)) return;
+  if (pthread_mutex_trylock(&cache->mutex)) {
+    sendAvailable(conn, season, day, day, 0, season->nUmbrella);
+    return;
+  }
+  //the readers may still be copying the current one
+  cached = cache->current == cache->reply ? cache->reply + 1 : cache->reply;
+  u64 gen = __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE);
+  u64 avail[BITSET_WORDS(season->nUmbrella)];
+  int found = findAvailable(season, day, day, 0, season->nUmbrella, avail);
+  __atomic_store_n(&cached->seq, cached->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  //sized once for the longest answer, the season never grows
+  if (cached->text == NULL) cached->text = malloc(sizeof("navailable") + idsSize(0, season->nUmbrella));
+  char *q;
+  if (!found) q = stpcpy(cached->text, "navailable");
+  else q = formatIds(stpcpy(cached->text, "available"), avail, 0, season->nUmbrella);
+  __atomic_store_n(&cached->len, q - cached->text + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&cached->day, day, __ATOMIC_RELAXED);
+  __atomic_store_n(&cached->gen, gen, __ATOMIC_RELAXED);
+  __atomic_store_n(&cached->seq, cached->seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&cache->current, cached, __ATOMIC_RELEASE);
+  replyData(conn, cached->text, cached->len);
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+//subscribes the connection to the umbrellas in [first, last) free from start to end,
+//replying with the ones free now; the reactor links it when it gets it back
+void startWatch(Connection *conn, Season *season, u32 first, u32 last, int start, int end) {
+  stopWatch(conn);
+  Watch *watch = conn->watch;
+  if (watch == NULL) watch = conn->watch = calloc(1, sizeof(Watch));
+  u32 words = BITSET_WORDS(season->nUmbrella);
+  if (watch->words != words) {
+    watch->words = words;
+    watch->free = realloc(watch->free, words * sizeof(u64));
+    watch->dirty = realloc(watch->dirty, words * sizeof(u64));
+  }
+  watch->season = season;
+  watch->first = first;
+  watch->last = last;
+  watch->start = start;
+  watch->end = end;
+  watch->active = 1;
+  memset(watch->dirty, 0, words * sizeof(u64));
+  memset(watch->free, 0, words * sizeof(u64));
+
+  //tracked before the snapshot, so no change after it is lost
+  if (!__atomic_load_n(&season->changed, __ATOMIC_ACQUIRE)) {
+    u64 *changed = calloc(server->nReactors * words, sizeof(u64));
+    u64 *expected = NULL;
+    if (!__atomic_compare_exchange_n(&season->changed, &expected, changed, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      free(changed);
+  }
+  __atomic_add_fetch(&season->watchers, 1, __ATOMIC_ACQ_REL);
+  sendAvailable(conn, season, start, end, first, last);
+  findAvailable(season, start, end, first, last, watch->free);
+}
+
+void stopWatch(Connection *conn) {
+  Watch *watch = conn->watch;
+  if (watch == NULL || !watch->active) return;
+  watch->active = 0;
+  __atomic_sub_fetch(&watch->season->watchers, 1, __ATOMIC_ACQ_REL);
+}
+
+//replies with the watched umbrellas that changed state since the last message
+void sendWatch(Connection *conn) {
+  Watch *watch = conn->watch;
+  if (watch == NULL || !watch->active) return;
+  if (__atomic_exchange_n(&watch->missed, 0, __ATOMIC_ACQ_REL))
+    memset(watch->dirty, 0xff, watch->words * sizeof(u64));
+
+  Season *season = watch->season;
+  int start = watch->start, end = watch->end;
+  int open = start <= end && start >= season->start && end <= season->end;
+  int w0 = start / 64, w1 = end / 64;
+  u64 mask[DAY_WORDS];
+  for (int w = w0; open && w <= w1; w++) mask[w] = dayMask(w, start, end);
+
+  u64 freed[watch->words], taken[watch->words];
+  memset(freed, 0, sizeof(freed));
+  memset(taken, 0, sizeof(taken));
+  int changed = 0;
+  for (u32 w = watch->first / 64; w < BITSET_WORDS(watch->last); w++) {
+    for (u64 bits = watch->dirty[w]; bits; bits &= bits - 1) {
+      u32 id = w * 64 + __builtin_ctzll(bits);
+      if (id < watch->first || id >= watch->last) continue;
+      u64 bit = 1ULL << (id % 64);
+      u64 isFree = open && !readBusy(season, id, w0, w1, mask) ? bit : 0;
+      if ((watch->free[w] & bit) == isFree) continue;
+      watch->free[w] ^= bit;
+      (isFree ? freed : taken)[w] |= bit;
+      changed = 1;
+    }
+  }
+  memset(watch->dirty, 0, watch->words * sizeof(u64));
+  if (!changed) return;
+  char *p = outReserve(conn, sizeof("watch free taken") + idsSize(watch->first, watch->last));
+  char *q = stpcpy(p, "watch"), *mark;
+  mark = q;
+  q = formatIds(stpcpy(q, " free"), freed, watch->first, watch->last);
+  if (q == mark + sizeof(" free") - 1) q = mark;
+  mark = q;
+  q = formatIds(stpcpy(q, " taken"), taken, watch->first, watch->last);
+  if (q == mark + sizeof(" taken") - 1) q = mark;
+  *q++ = 0;
+  conn->out.len += q - p;
+}
+
+//queues a binary reply with room for len bytes of payload, returns the payload;
+//the output buffer has no alignment, so the header is copied in
+char *binReply(Connection *conn, int op, int status, size_t len) {
+  BinReply header = {op, status, 0, len};
+  char *p = outReserve(conn, sizeof(BinReply) + len);
+  memcpy(p, &header, sizeof(BinReply));
+  conn->out.len += sizeof(BinReply) + len;
+  return p + sizeof(BinReply);
+}
+
+int handleBinary(Connection *conn, BinRequest *req) {
+  Season *season = conn->season;
+  int today = getCurrentYday();
+  int start = req->start < 0 ? today : req->start;
+  int end = req->end < 0 ? today : req->end;
+  if (conn->state == CONN_LOGIN && req->op != BIN_LOGIN) {
+    binReply(conn, req->op, BIN_FAILED, 0);
+    return 0;
+  }
+  if ((season->readOnly && (req->op == BIN_BOOK || req->op == BIN_CANCEL)) ||
+      ((req->op == BIN_AVAILABLE || req->op == BIN_AVAILROW) && replicaStale(season))) {
+    binReply(conn, req->op, BIN_FAILED, 0);
+    return 0;
+  }
+
+  switch (req->op) {
+  case BIN_LOGIN:
+    conn->user = req->arg;
+    conn->state = CONN_READY;
+    binReply(conn, req->op, BIN_OK, 0);
+    break;
+
+  case BIN_AVAILABLE:
+  case BIN_AVAILROW: {
+    u32 first = 0, last = season->nUmbrella;
+    if (req->op == BIN_AVAILROW) {
+      if (req->row >= season->nRows) {
+        binReply(conn, req->op, BIN_FAILED, 0);
+        break;
+      }
+      first = req->row * season->nCols;
+      last = first + season->nCols;
+    }
+    //the bitset goes in the reply with a single copy
+    u32 w0 = first / 64, nWords = BITSET_WORDS(last) - w0;
+    u64 avail[BITSET_WORDS(last)];
+    u32 head[2] = {w0 * 64, findAvailable(season, start, end, first, last, avail)};
+    char *payload = binReply(conn, req->op, head[1] ? BIN_OK : BIN_NAVAILABLE,
+        sizeof(head) + nWords * sizeof(u64));
+    memcpy(payload, head, sizeof(head));
+    memcpy(payload + sizeof(head), avail + w0, nWords * sizeof(u64));
+    break;
+  }
+
+  case BIN_BOOK:
+    if (!addBooking(season, conn->user, req->arg, start, end)) binReply(conn, req->op, BIN_OK, 0);
+    else binReply(conn, req->op, BIN_NAVAILABLE, 0);
+    break;
+
+  case BIN_CANCEL:
+    if (!removeBooking(season, conn->user, req->arg)) binReply(conn, req->op, BIN_OK, 0);
+    else binReply(conn, req->op, BIN_FAILED, 0);
+    break;
+
+  case BIN_LOGOUT:
+    binReply(conn, req->op, BIN_OK, 0);
+    return -1;
+
+  default:
+    binReply(conn, req->op, BIN_FAILED, 0);
+  }
+  return 0;
+}
+
+static void rejectRow(Bulk *bulk, u32 line) {
+  if (bulk->rejected < BULK_REPORT) bulk->report[bulk->rejected] = line;
+  bulk->rejected++;
+}
+
+//books the rows collected so far, they are durable once it returns
+static void applyBulk(Connection *conn) {
+  Bulk *bulk = conn->bulk;
+  bulkBookings(conn->season, bulk->row, bulk->n);
+  for (int i = 0; i < bulk->n; i++) {
+    BulkRow *row = bulk->row + i;
+    if (row->status == BULK_ADDED) bulk->added++;
+    else if (row->status == BULK_PRESENT) bulk->present++;
+    else rejectRow(bulk, row->line);
+  }
+  bulk->n = 0;
+  //the batches may run on different workers, the reply alone would not wait for them
+  walCommit(&conn->season->wal);
+}
+
+static void endBulk(Connection *conn) {
+  Bulk *bulk = conn->bulk;
+  applyBulk(conn);
+  String text = {};
+  dcatf(&text, "bulk added %u present %u rejected %u", bulk->added, bulk->present, bulk->rejected);
+  if (bulk->rejected) {
+    dcatf(&text, "\nrejected");
+    for (u32 i = 0; i < bulk->rejected && i < BULK_REPORT; i++) dcatf(&text, " %u", bulk->report[i]);
+  }
+  replyOwned(conn, text.str);
+  free(bulk);
+  conn->bulk = NULL;
+  conn->state = CONN_READY;
+}
+
+int handleCommand(Connection *conn) {
+  Season *season = conn->season;
+  char **toks = conn->toks;
+  int nToks = conn->nToks;
+  u32 user = conn->user;
+
+  if (conn->state <= CONN_READY && ckm(toks[0], "binary", nToks, 1)) {
+    stopWatch(conn);
+    conn->binary = 1;
+    reply(conn, "ok");
+    return 0;
+  }
+
+  switch (conn->state) {
+  case CONN_LOGIN:
+    if (ckm(toks[0], "login", nToks, 2)) {
+      conn->user = atoi(toks[1]);
+      conn->state = CONN_READY;
+      reply(conn, "ok");
+    } else reply(conn, "nlogin");
+    return 0;
+
+  case CONN_BOOK:
+    conn->state = CONN_READY;
+    if (ckm(toks[0], "book", nToks, 2) ||
+        ckm(toks[0], "book", nToks, 3) ||
+        ckm(toks[0], "book", nToks, 4)) {
+      //with no dates the whole season is leased, whatever is booked already
+      int start = season->start, end = season->end;
+      if (nToks == 3) {
+        start = getCurrentYday();
+        end = parseDate(toks[2], season->year);
+      } else if (nToks == 4) {
+        start = parseDate(toks[2], season->year);
+        end = parseDate(toks[3], season->year);
+      }
+      conn->umbrella = atoi(toks[1]);
+      if (!takeLease(season, user, conn->umbrella, start, end, nToks > 2)) {
+        conn->state = CONN_BOOK_DATES;
+        reply(conn, "available");
+      } else reply(conn, "navailable");
+    } else reply(conn, "failed");
+    return 0;
+
+  case CONN_BOOK_DATES:
+    conn->state = CONN_READY;
+    if (ckm(toks[0], "book", nToks, 3) ||
+        ckm(toks[0], "book", nToks, 4)) {
+      int start, end;
+      if (nToks < 4) {
+        start = getCurrentYday();
+        end = parseDate(toks[2], season->year);
+      } else {
+        start = parseDate(toks[2], season->year);
+        end = parseDate(toks[3], season->year);
+      }
+      if (!addBooking(season, user, conn->umbrella, start, end)) { // se data disponibile
+        reply(conn, "done");
+      } else {
+        reply(conn, "navailable");
+        releaseLease(season, user, conn->umbrella);
+      }
+
+    } else if (ckm(toks[0], "cancel", nToks, 1)) {
+      releaseLease(season, user, conn->umbrella);
+      reply(conn, "ok");
+
+    } else reply(conn, "failed");
+    return 0;
+
+  case CONN_BULK:
+    if (ckm(toks[0], "commit", nToks, 1)) {
+      endBulk(conn);
+    } else {
+      Bulk *bulk = conn->bulk;
+      BulkRow *row = bulk->row + bulk->n;
+      row->line = ++bulk->line;
+      if (parseBulkRow(season, toks, nToks, row)) rejectRow(bulk, row->line);
+      else if (++bulk->n == BULK_BATCH) applyBulk(conn);
+    }
+    return 0;
+  }
+
+  if (season->readOnly) {
+    //the replicas only answer the queries, and only while they keep up with the primary
+    char *writes[] = {"book", "bookgroup", "cancel", "save", "export", "load", "unload", "bulk"};
+    char *reads[] = {"available", "availrow", "findrow", "mybookings", "watch"};
+    for (int i = 0; i < sizeof(writes) / sizeof(*writes); i++) {
+      if (!strcmp(toks[0], writes[i])) {
+        reply(conn, "readonly");
+        return 0;
+      }
+    }
+    for (int i = 0; i < sizeof(reads) / sizeof(*reads); i++) {
+      if (!strcmp(toks[0], reads[i]) && replicaStale(season)) {
+        reply(conn, "stale");
+        return 0;
+      }
+    }
+  }
+
+  if (ckm(toks[0], "book", nToks, 1)) {
+    conn->state = CONN_BOOK;
+    reply(conn, "ok");
+
+  } else if (ckm(toks[0], "bulk", nToks, 1)) {
+    //the rows get no reply, the tally comes with the one to commit
+    conn->bulk = calloc(1, sizeof(Bulk));
+    conn->state = CONN_BULK;
+    reply(conn, "ok");
+
+  } else if (ckm(toks[0], "available", nToks, 3) ||
+             ckm(toks[0], "available", nToks, 2) ||
+             ckm(toks[0], "available", nToks, 1)) {
+    int start, end;
+    if (nToks == 1) {
+      sendToday(conn, season);
+      return 0;
+    } else if (nToks == 2) {
+      start = getCurrentYday();
+      end = parseDate(toks[1], season->year);
+    } else {
+      start = parseDate(toks[1], season->year);
+      end = parseDate(toks[2], season->year);
+    }
+    sendAvailable(conn, season, start, end, 0, season->nUmbrella);
+
+  } else if (ckm(toks[0], "availrow", nToks, 4) ||
+      ckm(toks[0], "availrow", nToks, 3) ||
+      ckm(toks[0], "availrow", nToks, 2)) {
+    int start, end;
+    if (nToks == 2) {
+      start = end = getCurrentYday();
+    } else if (nToks == 3) {
+      start = getCurrentYday();
+      end = parseDate(toks[2], season->year);
+    } else {
+      start = parseDate(toks[2], season->year);
+      end = parseDate(toks[3], season->year);
+    }
+    int row = atoi(toks[1]);
+    int is = row * season->nCols;
+    int ie = is + season->nCols;
+    if (row < 0 || row >= season->nRows) reply(conn, "navailable");
+    else sendAvailable(conn, season, start, end, is, ie);
+
+  } else if (ckm(toks[0], "bookgroup", nToks, 3) ||
+             ckm(toks[0], "bookgroup", nToks, 4)) {
+    int start, end;
+    if (nToks == 3) {
+      start = getCurrentYday();
+      end = parseDate(toks[2], season->year);
+    } else {
+      start = parseDate(toks[2], season->year);
+      end = parseDate(toks[3], season->year);
+    }
+    u32 ids[MAX_GROUP];
+    int n = 0;
+    char *tokstate;
+    for (char *id = strtok_r(toks[1], ",", &tokstate); id; id = strtok_r(NULL, ",", &tokstate)) {
+      if (n == MAX_GROUP) {
+        n = 0;
+        break;
+      }
+      ids[n++] = atoi(id);
+    }
+    if (n == 0) reply(conn, "failed");
+    else if (!addGroupBooking(season, user, ids, n, start, end)) reply(conn, "done");
+    else reply(conn, "navailable");
+
+  } else if (ckm(toks[0], "findrow", nToks, 5) ||
+             ckm(toks[0], "findrow", nToks, 4) ||
+             ckm(toks[0], "findrow", nToks, 3)) {
+    int start, end;
+    if (nToks == 3) {
+      start = end = getCurrentYday();
+    } else if (nToks == 4) {
+      start = getCurrentYday();
+      end = parseDate(toks[3], season->year);
+    } else {
+      start = parseDate(toks[3], season->year);
+      end = parseDate(toks[4], season->year);
+    }
+    int n = atoi(toks[2]);
+    int first = findAdjacent(season, atoi(toks[1]), n, start, end);
+    if (first == -1) reply(conn, "navailable");
+    else {
+      char *p = outReserve(conn, sizeof("available") + idsSize(first, first + n));
+      char *q = stpcpy(p, "available");
+      for (int i = first; i < first + n; i++) {
+        *q++ = ' ';
+        q = formatUint(q, i);
+      }
+      *q++ = 0;
+      conn->out.len += q - p;
+    }
+
+  } else if (ckm(toks[0], "cancel", nToks, 2) && !strcmp(toks[1], "all")) {
+    removeAllBookings(season, user);
+    reply(conn, "cancel ok");
+  } else if (ckm(toks[0], "mybookings", nToks, 1)) {
+    UserBooking *booking;
+    int count = userBookings(season, user, &booking);
+    qsort(booking, count, sizeof(UserBooking), compareUserBookings);
+    replyData(conn, "mybookings", sizeof("mybookings") - 1);
+    for (int i = 0; i < count; i++) {
+      char *p = outReserve(conn, 80), *q = p;
+      *q++ = '\n';
+      q = formatUint(q, booking[i].umbrella);
+      *q++ = ' ';
+      getDateString(q, 32, season->year, booking[i].start);
+      q += strlen(q);
+      *q++ = ' ';
+      getDateString(q, 32, season->year, booking[i].end);
+      q += strlen(q);
+      conn->out.len += q - p;
+    }
+    replyData(conn, "", 1);
+    free(booking);
+  } else if (ckm(toks[0], "cancel", nToks, 2)) {
+    int nUmbrella = atoi(toks[1]);
+    if (!removeBooking(season, user, nUmbrella)) reply(conn, "cancel ok");
+    else reply(conn, "failed");
+  } else if (ckm(toks[0], "logout", nToks, 1)) {
+    reply(conn, "bye");
+    return -1;
+  } else if (ckm(toks[0], "save", nToks, 1)) {
+    saveBookingList(season);
+    reply(conn, "ok");
+  } else if (ckm(toks[0], "export", nToks, 1)) {
+    char path[256];
+    seasonPath(season, path, sizeof(path), savefile);
+    exportBookingList(season, path);
+    reply(conn, "ok");
+  } else if (ckm(toks[0], "today", nToks, 1)) {
+    char dateStr[32];
+    getDateString(dateStr, 32, season->year, getCurrentYday());
+    reply(conn, dateStr);
+  } else if (ckm(toks[0], "start", nToks, 1)) {
+    char dateStr[32];
+    getDateString(dateStr, 32, season->year, season->start);
+    reply(conn, dateStr);
+  } else if (ckm(toks[0], "end", nToks, 1)) {
+    char dateStr[32];
+    getDateString(dateStr, 32, season->year, season->end);
+    reply(conn, dateStr);
+  } else if (!strcmp(toks[0], "watch") && nToks <= 4) {
+    //the row is the token without slashes, the dates follow like in available
+    int row = -1, first = 1;
+    if (nToks > 1 && !strchr(toks[1], '/')) {
+      row = atoi(toks[1]);
+      first = 2;
+    }
+    int start, end;
+    if (nToks - first == 0) {
+      start = end = getCurrentYday();
+    } else if (nToks - first == 1) {
+      start = getCurrentYday();
+      end = parseDate(toks[first], season->year);
+    } else {
+      start = parseDate(toks[first], season->year);
+      end = parseDate(toks[first + 1], season->year);
+    }
+    if (row >= season->nRows || (row < 0 && first == 2)) reply(conn, "failed");
+    else if (row == -1) startWatch(conn, season, 0, season->nUmbrella, start, end);
+    else startWatch(conn, season, row * season->nCols, (row + 1) * season->nCols, start, end);
+  } else if (ckm(toks[0], "unwatch", nToks, 1)) {
+    stopWatch(conn);
+    reply(conn, "ok");
+  } else if (ckm(toks[0], "use", nToks, 2)) {
+    Season *next = acquireSeason(toks[1]);
+    if (next == NULL) {
+      reply(conn, "nbeach");
+    } else {
+      stopWatch(conn);
+      //what was logged before the switch must be durable in the old log
+      walCommit(&season->wal);
+      conn->season = next;
+      releaseSeason(season);
+      reply(conn, "ok");
+    }
+  } else if (ckm(toks[0], "beaches", nToks, 1)) {
+    String text = {};
+    dcatf(&text, "beaches");
+    pthread_mutex_lock(&beaches.mutex);
+    for (int i = 0; i < beaches.count; i++)
+      if (!beaches.season[i]->unloaded) dcatf(&text, " %s", beaches.season[i]->name);
+    pthread_mutex_unlock(&beaches.mutex);
+    replyOwned(conn, text.str);
+  } else if (ckm(toks[0], "load", nToks, 2)) {
+    if (!loadBeach(toks[1])) reply(conn, "ok");
+    else reply(conn, "failed");
+  } else if (ckm(toks[0], "unload", nToks, 2)) {
+    if (!unloadBeach(toks[1])) reply(conn, "ok");
+    else reply(conn, "failed");
+  } else if (ckm(toks[0], "stats", nToks, 1)) {
+    String text = {};
+    statsText(&text, 0);
+    replyOwned(conn, text.str);
+  } else if (ckm(toks[0], "help", nToks, 1)) {
+    reply(conn, commands);
+  } else reply(conn, "unknown");
+  return 0;
+}
+
+void initJobQueue(JobQueue *queue) {
+  queue->head = queue->tail = NULL;
+  queue->stop = 0;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+}
+
+void pushJob(JobQueue *queue, Connection *conn) {
+  conn->nextJob = NULL;
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->tail) queue->tail->nextJob = conn;
+  else queue->head = conn;
+  queue->tail = conn;
+  pthread_cond_signal(&queue->cond);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+Connection *popJob(JobQueue *queue, int wait) {
+  pthread_mutex_lock(&queue->mutex);
+  while (wait && queue->head == NULL && !queue->stop)
+    pthread_cond_wait(&queue->cond, &queue->mutex);
+  Connection *conn = queue->head;
+  if (conn) {
+    queue->head = conn->nextJob;
+    if (queue->head == NULL) queue->tail = NULL;
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return conn;
+}
+
+void armConnection(Reactor *reactor, Connection *conn, int op) {
+  struct epoll_event ev = {0};
+  //no new command is read while the replies of the last ones are waiting
+  ev.events = (conn->out.len ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  conn->busy = 0;
+  CHECK(epoll_ctl(reactor->epfd, op, conn->csd, &ev));
+}
+
+static void timerLink(Reactor *reactor, Connection *conn, time_t when) {
+  conn->timerSlot = when % WHEEL_SLOTS;
+  conn->timerPrev = NULL;
+  conn->timerNext = reactor->wheel[conn->timerSlot];
+  if (conn->timerNext) conn->timerNext->timerPrev = conn;
+  reactor->wheel[conn->timerSlot] = conn;
+}
+
+static void timerUnlink(Reactor *reactor, Connection *conn) {
+  if (conn->timerSlot == -1) return;
+  if (conn->timerPrev) conn->timerPrev->timerNext = conn->timerNext;
+  else reactor->wheel[conn->timerSlot] = conn->timerNext;
+  if (conn->timerNext) conn->timerNext->timerPrev = conn->timerPrev;
+  conn->timerSlot = -1;
+}
+
+static void unlinkWatch(Connection *conn) {
+  Watch *watch = conn->watch;
+  if (watch->group == NULL) return;
+  if (watch->prev) watch->prev->watch->next = watch->next;
+  else watch->group->head = watch->next;
+  if (watch->next) watch->next->watch->prev = watch->prev;
+  watch->group = NULL;
+}
+
+static void freeWatch(Connection *conn) {
+  Watch *watch = conn->watch;
+  if (watch == NULL) return;
+  stopWatch(conn);
+  unlinkWatch(conn);
+  free(watch->free);
+  free(watch->dirty);
+  free(watch);
+  conn->watch = NULL;
+}
+
+//links a connection coming back from a worker among the watchers, or frees its ended watch,
+//returns 1 if a worker has to look at its changes
+static int syncWatch(Reactor *reactor, Connection *conn) {
+  Watch *watch = conn->watch;
+  if (watch == NULL) return 0;
+  if (!watch->active) {
+    freeWatch(conn);
+    return 0;
+  }
+  if (watch->group && watch->group->season != watch->season) unlinkWatch(conn);
+  if (watch->group == NULL) {
+    WatchGroup *group = NULL;
+    for (int i = 0; i < reactor->nWatch && !group; i++)
+      if (reactor->watch[i].head && reactor->watch[i].season == watch->season) group = reactor->watch + i;
+    for (int i = 0; i < reactor->nWatch && !group; i++)
+      if (!reactor->watch[i].head) group = reactor->watch + i;
+    if (group == NULL) {
+      reactor->watch = realloc(reactor->watch, ++reactor->nWatch * sizeof(WatchGroup));
+      group = reactor->watch + reactor->nWatch - 1;
+      group->head = NULL;
+      group->batch = NULL;
+    }
+    if (group->head == NULL) {
+      group->season = watch->season;
+      group->batch = realloc(group->batch, watch->words * sizeof(u64));
+    }
+    watch->group = group;
+    watch->prev = NULL;
+    watch->next = group->head;
+    if (group->head) group->head->watch->prev = conn;
+    group->head = conn;
+    //the changes since its snapshot went to the watchers already linked
+    __atomic_store_n(&watch->missed, 1, __ATOMIC_RELEASE);
+  }
+  return __atomic_load_n(&watch->missed, __ATOMIC_ACQUIRE);
+}
+
+//hands an idle connection to a worker with no input, it is not polled until it returns
+static void dispatchIdle(Reactor *reactor, Connection *conn) {
+  struct epoll_event ev = {0};
+  ev.data.ptr = conn;
+  CHECK(epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, conn->csd, &ev));
+  conn->busy = 1;
+  pushJob(&conn->season->jobs, conn);
+}
+
+//takes the umbrellas changed since the last pass once per season and hands them to the
+//watchers, a busy one looks at all its umbrellas again when it comes back
+void notifyWatchers(Reactor *reactor) {
+  if (!__atomic_exchange_n(&reactor->notify, 0, __ATOMIC_ACQ_REL)) return;
+  for (int i = 0; i < reactor->nWatch; i++) {
+    WatchGroup *group = reactor->watch + i;
+    if (group->head == NULL) continue;
+    Season *season = group->season;
+    u32 words = BITSET_WORDS(season->nUmbrella);
+    u64 *changed = season->changed + reactor->id * words, any = 0;
+    for (u32 w = 0; w < words; w++)
+      any |= group->batch[w] = __atomic_exchange_n(changed + w, 0, __ATOMIC_ACQ_REL);
+    if (!any) continue;
+
+    for (Connection *conn = group->head, *next; conn; conn = next) {
+      Watch *watch = conn->watch;
+      next = watch->next;
+      if (conn->busy) {
+        __atomic_store_n(&watch->missed, 1, __ATOMIC_RELEASE);
+        continue;
+      }
+      u64 mine = 0;
+      for (u32 w = watch->first / 64; w < BITSET_WORDS(watch->last); w++)
+        mine |= watch->dirty[w] |= group->batch[w];
+      if (mine) dispatchIdle(reactor, conn);
+    }
+  }
+}
+
+void dropConnection(Connection *conn) {
+  logPrint(LOG_DEBUG, "connessione %d chiusa, utente %u\n", conn->id, conn->user);
+  timerUnlink(server->reactor + conn->reactor, conn);
+  freeWatch(conn);
+  if (conn->state == CONN_BOOK_DATES) releaseLease(conn->season, conn->user, conn->umbrella);
+  //the rows not booked yet are dropped with it
+  free(conn->bulk);
+  conn->bulk = NULL;
+  releaseSeason(conn->season);
+  conn->season = NULL;
+  close(conn->csd);
+  removeConnection(conn->list, conn->id);
+}
+
+//activity only updates lastActive, a connection is looked at again when its slot
+//comes up: silent ones are closed, the others move to the slot of their deadline
+void expireIdle(Reactor *reactor, time_t now) {
+  if (now - reactor->wheelTime > WHEEL_SLOTS) reactor->wheelTime = now - WHEEL_SLOTS;
+  while (reactor->wheelTime < now) {
+    time_t tick = ++reactor->wheelTime;
+    Connection *conn = reactor->wheel[tick % WHEEL_SLOTS];
+    reactor->wheel[tick % WHEEL_SLOTS] = NULL;
+    while (conn) {
+      Connection *next = conn->timerNext;
+      conn->timerSlot = -1;
+      time_t deadline = conn->lastActive + IDLE_TIMEOUT + 1;
+      if (deadline > tick) timerLink(reactor, conn, deadline);
+      else if (conn->busy) timerLink(reactor, conn, tick + 1);
+      //a watcher is expected to stay silent
+      else if (conn->watch && conn->watch->active) timerLink(reactor, conn, tick + IDLE_TIMEOUT);
+      else dropConnection(conn);
+      conn = next;
+    }
+  }
+}
+
+void *reactorLoop(void *arg) {
+  Reactor *reactor = (Reactor *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    int n = epoll_wait(reactor->epfd, events, MAX_EVENTS, 1000);
+    if (n == -1 && errno != EINTR) _exitErrno(errno, "epoll_wait", __LINE__);
+    if (__atomic_load_n(&reactor->stop, __ATOMIC_ACQUIRE)) break;
+
+    for (int i = 0; i < n; i++) {
+      Connection *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        u64 val;
+        read(reactor->wakefd, &val, sizeof(val));
+        while ((conn = popJob(&reactor->done, 0))) {
+          if (conn->timerSlot == -1) {
+            timerLink(reactor, conn, conn->lastActive + IDLE_TIMEOUT + 1);
+            armConnection(reactor, conn, EPOLL_CTL_ADD);
+          } else if (conn->closing && conn->out.len == 0) {
+            dropConnection(conn);
+          } else if (syncWatch(reactor, conn)) {
+            conn->busy = 1;
+            pushJob(&conn->season->jobs, conn);
+          } else {
+            armConnection(reactor, conn, EPOLL_CTL_MOD);
+          }
+        }
+        continue;
+      }
+
+      if (conn->out.len) {
+        //the rest of the replies the worker could not write
+        int left = writeOutput(conn);
+        if (left == -1 || (left == 0 && conn->closing)) {
+          dropConnection(conn);
+        } else {
+          //a peer that reads is not idle
+          conn->lastActive = time(NULL);
+          armConnection(reactor, conn, EPOLL_CTL_MOD);
+        }
+        continue;
+      }
+
+      fillInput(conn);
+      if (hasCommand(conn)) {
+        conn->busy = 1;
+        conn->lastActive = time(NULL);
+        pushJob(&conn->season->jobs, conn);
+      } else if (conn->eof) {
+        dropConnection(conn);
+      } else {
+        armConnection(reactor, conn, EPOLL_CTL_MOD);
+      }
+    }
+
+    notifyWatchers(reactor);
+    expireIdle(reactor, time(NULL));
+  }
+  return NULL;
+}
+
+void *workerLoop(void *arg) {
+  Season *season = (Season *)arg;
+  Connection *conn;
+  while ((conn = popJob(&season->jobs, 1))) {
+    if (processInput(conn) == -1) conn->closing = 1;
+    Reactor *reactor = server->reactor + conn->reactor;
+    pushJob(&reactor->done, conn);
+    u64 one = 1;
+    write(reactor->wakefd, &one, sizeof(one));
+  }
+  return NULL;
+}
+
+void stopServer(Server *server) {
+  //shutdown wakes the listener blocked in accept
+  for (int i = 0; i < server->nListeners; i++) {
+    __atomic_store_n(&conns[i].closed, 1, __ATOMIC_RELEASE);
+    shutdown(conns[i].msd, SHUT_RDWR);
+    pthread_join(conns[i].listener, NULL);
+  }
+  for (int i = 0; i < server->nReactors; i++) {
+    Reactor *reactor = server->reactor + i;
+    __atomic_store_n(&reactor->stop, 1, __ATOMIC_RELEASE);
+    u64 one = 1;
+    write(reactor->wakefd, &one, sizeof(one));
+    pthread_join(reactor->thread, NULL);
+  }
+
+  //a reference keeps a beach from being closed meanwhile, one whose references are
+  //gone already has a closer joining its workers
+  pthread_mutex_lock(&beaches.mutex);
+  Season **seasons = malloc((beaches.count + 1) * sizeof(Season *));
+  int n = 0;
+  for (int i = 0; i < beaches.count; i++) {
+    Season *season = beaches.season[i];
+    int refs = __atomic_load_n(&season->refs, __ATOMIC_ACQUIRE);
+    while (refs && !__atomic_compare_exchange_n(&season->refs, &refs, refs + 1, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (refs) seasons[n++] = season;
+  }
+  pthread_mutex_unlock(&beaches.mutex);
+  for (int i = 0; i < n; i++) {
+    Season *season = seasons[i];
+    pthread_mutex_lock(&season->jobs.mutex);
+    season->jobs.stop = 1;
+    pthread_cond_broadcast(&season->jobs.cond);
+    pthread_mutex_unlock(&season->jobs.mutex);
+    for (int j = 0; j < season->nWorkers; j++) pthread_join(season->workers[j], NULL);
+  }
+  free(seasons);
+}
 
-  u32 i;
-  for (i = 0; i < list->count; i++) {
-    if (array[i].end >= start) {
-      if (array[i].start > end) break;
-      else goto fail;
-    }
+void initServer(Server *server) {
+  server->reactor = calloc(server->nReactors, sizeof(Reactor));
+  for (int i = 0; i < server->nReactors; i++) {
+    Reactor *reactor = server->reactor + i;
+    reactor->id = i;
+    reactor->wheelTime = time(NULL);
+    initJobQueue(&reactor->done);
+    CHECK(reactor->epfd = epoll_create1(0));
+    CHECK(reactor->wakefd = eventfd(0, EFD_NONBLOCK));
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    CHECK(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev));
+    pthread_create(&reactor->thread, NULL, reactorLoop, reactor);
+  }
+  if (server->metricsPort > 0) {
+    pthread_t metrics;
+    pthread_create(&metrics, NULL, metricsLoop, NULL);
   }
-  if(testOnly) goto success;
+  pthread_t replication;
+  if (server->replPort > 0) {
+    beaches.season[0]->wal.replicate = 1;
+    pthread_create(&replication, NULL, replicationLoop, NULL);
+  }
+  if (server->primaryPort > 0)
+    pthread_create(&replication, NULL, replicaLoop, beaches.season[0]);
+}
 
-  if (list->count == list->capacity) {
-    list->capacity += list->capacity + 1;
-    array = list->booking = realloc(list->booking, sizeof(Booking) * list->capacity);
+void attachConnection(Server *server, Connection *conn) {
+  //shared by the listener threads
+  static u32 nextReactor = 0;
+  u32 next = __atomic_fetch_add(&nextReactor, 1, __ATOMIC_RELAXED);
+  Reactor *reactor = server->reactor + next % server->nReactors;
+  conn->reactor = reactor->id;
+  conn->state = CONN_LOGIN;
+  conn->closing = 0;
+  conn->user = 0;
+  conn->binary = conn->eof = conn->discard = 0;
+  conn->inHead = conn->inTail = 0;
+  conn->out.len = conn->out.sent = 0;
+  if (conn->out.size > OUT_SIZE) {
+    free(conn->out.buf);
+    conn->out.buf = NULL;
+    conn->out.size = 0;
   }
-  if (i < list->count)
-    memmove(array + i + 1, array + i, (list->count - i) * sizeof(Booking));
+  conn->lastActive = time(NULL);
+  conn->season = acquireSeason(NULL);
+  fcntl(conn->csd, F_SETFL, fcntl(conn->csd, F_GETFL) | O_NONBLOCK);
+  swrite(conn->csd, "welcome");
+  logPrint(LOG_DEBUG, "connessione %d aperta sul reactor %d\n", conn->id, conn->reactor);
+  //the reactor alone touches its timer wheel, it arms the connection once it takes it in
+  conn->timerSlot = -1;
+  pushJob(&reactor->done, conn);
+  u64 one = 1;
+  write(reactor->wakefd, &one, sizeof(one));
+}
 
-  array[i].user = user;
-  array[i].start = start;
-  array[i].end = end;
-  list->count++;
-  list->lockUser = 0;
-  list->lockDay = 0;
-success:
-  pthread_mutex_unlock(&list->mutex);
-  return 0;
-fail:
-  pthread_mutex_unlock(&list->mutex);
+Season *openSeason(const char *name, const char *dir, const char *config, Server *server) {
+  Season *season = calloc(1, sizeof(Season));
+  snprintf(season->name, sizeof(season->name), "%s", name);
+  snprintf(season->dir, sizeof(season->dir), "%s", dir);
+  seasonPath(season, season->wal.base, sizeof(season->wal.base), walfile);
+  season->nWorkers = 4;
+  season->leaseTime = LEASE_TIME;
+  if (loadConfig(season, server, config)) {
+    free(season);
+    return NULL;
+  }
+  season->readOnly = server && server->primaryPort;
+  //beachctl import writes the files only while no server has the beach open
+  if (!season->readOnly && lockSeason(season, config)) {
+    logPrint(LOG_ERROR, "Spiaggia %s già in uso da un altro processo.\n", name);
+    free(season);
+    return NULL;
+  }
+  initBookingList(season);
+  if (season->readOnly) {
+    //a replica keeps no files, its lists come from the primary
+    buildUserIndex(season);
+  } else {
+    loadBookingList(season);
+    if (season->checkpointInterval > 0)
+      pthread_create(&season->checkpointThread, NULL, checkpointLoop, season);
+  }
+  initToday(season);
+  initJobQueue(&season->jobs);
+  season->workers = calloc(season->nWorkers, sizeof(pthread_t));
+  for (int i = 0; i < season->nWorkers; i++)
+    pthread_create(season->workers + i, NULL, workerLoop, season);
+  season->refs = 1;
+  return season;
+}
+
+int lockSeason(Season *season, const char *config) {
+  season->lockFd = open(config, O_RDONLY);
+  if (season->lockFd != -1 && !flock(season->lockFd, LOCK_EX | LOCK_NB)) return 0;
+  if (season->lockFd != -1) close(season->lockFd);
+  season->lockFd = -1;
   return -1;
 }
 
-//returns 0 if the booking is available
-int testBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end) {
-  return _testSetBooking(season, user, idUmbrella, start, end, 1);
+void closeSeason(Season *season) {
+  pthread_mutex_lock(&season->jobs.mutex);
+  season->jobs.stop = 1;
+  pthread_cond_broadcast(&season->jobs.cond);
+  pthread_mutex_unlock(&season->jobs.mutex);
+  for (int i = 0; i < season->nWorkers; i++) pthread_join(season->workers[i], NULL);
+  if (season->checkpointInterval > 0 && !season->readOnly) {
+    __atomic_store_n(&season->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(season->checkpointThread, NULL);
+  }
+  if (!season->readOnly) {
+    saveBookingList(season);
+    stopWal(&season->wal);
+    close(season->lockFd);
+  }
+
+  pthread_mutex_lock(&beaches.mutex);
+  for (int i = 0; i < beaches.count; i++) {
+    if (beaches.season[i] != season) continue;
+    beaches.season[i] = beaches.season[--beaches.count];
+    break;
+  }
+  pthread_mutex_unlock(&beaches.mutex);
+  mprintf("Spiaggia %s chiusa.\n", season->name);
+  freeSeason(season);
 }
-//returns 0 if the booking is successful
-int addBooking(Season *season, u32 user, u32 idUmbrella, i16 start, i16 end) {
-  return _testSetBooking(season, user, idUmbrella, start, end, 0);
+
+void freeSeason(Season *season) {
+  for (int i = 0; i < season->nUmbrella; i++) {
+    freeBookings(season, season->bookingList + i);
+    pthread_mutex_destroy(&season->lock[i].mutex);
+  }
+  freeArena(&season->arena);
+  for (int i = 0; season->users && i < USER_STRIPES; i++) {
+    UserStripe *stripe = season->users + i;
+    for (u32 j = 0; j < stripe->size; j++) free(stripe->entry[j].booking);
+    free(stripe->entry);
+  }
+  if (season->snap) munmap(season->snap, season->snapSize);
+  free(season->users);
+  free(season->bookingList);
+  free(season->lock);
+  free(season->version);
+  free(season->dirty);
+  free(season->days);
+  free(season->byDay);
+  free(season->workers);
+  free(season->changed);
+  free(season->today.set);
+  free(season->today.spare);
+  free(season->today.reply[0].text);
+  free(season->today.reply[1].text);
+  expireLeases(&season->leases, time(NULL) + LEASE_SLOTS);
+  free(season->leases.umbrella);
+  pthread_mutex_destroy(&season->today.mutex);
+  free(season);
 }
 
-int swrite(int socket, char *text) {
-  int size = strlen(text) + 1;
-  return write(socket, text, size);
+static void *closeSeasonLoop(void *season) {
+  closeSeason(season);
+  return NULL;
 }
 
-int readToks(int csd, char *buffer, size_t bufferSize, char *toks[], int maxToks) {
-  static const char sep[] = " \n\r";
-  int error = read(csd, buffer, bufferSize);
-  if (error < 1) return error;
-  if (error >= bufferSize) error = bufferSize -1;
-  buffer[error] = 0;
-  char *tokstate;
-  int nToks = 0;
-  toks[0] = strtok_r(buffer, sep, &tokstate);
-  while(toks[nToks]) {
-    nToks++;
-    if (nToks >= maxToks) break;
-    toks[nToks] = strtok_r(NULL, sep, &tokstate);
+Season *acquireSeason(const char *name) {
+  Season *season = NULL;
+  pthread_mutex_lock(&beaches.mutex);
+  for (int i = 0; i < beaches.count && !season; i++) {
+    Season *s = beaches.season[i];
+    if (!s->unloaded && (name ? !strcmp(s->name, name) : i == 0)) season = s;
   }
-  return nToks;
+  //the registry holds a reference until the unload, so it can't be closing here
+  if (season) __atomic_add_fetch(&season->refs, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&beaches.mutex);
+  return season;
 }
 
-int ckm(char *a, char *b, int n1, int n2) {
-  return !strcmp(a, b) && n1 == n2;
+void releaseSeason(Season *season) {
+  if (season == NULL || __atomic_sub_fetch(&season->refs, 1, __ATOMIC_ACQ_REL)) return;
+  //saving takes a while and the caller may be one of its workers
+  pthread_t closer;
+  pthread_create(&closer, NULL, closeSeasonLoop, season);
+  pthread_detach(closer);
 }
 
-void *socketListener(void *connection) {
-  Connection *conn = (Connection *)connection;
-  int csd = conn->csd;
-  int logged = 0;
-  int user = 0;
-  struct timeval tv = {0};
-  tv.tv_sec = 60;
-  setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(struct timeval));
+int loadBeach(const char *name) {
+  size_t len = strlen(name);
+  if (len == 0 || len >= sizeof(((Season *)0)->name)) return -1;
+  for (size_t i = 0; i < len; i++)
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') return -1;
 
-  swrite(csd, "welcome");
+  char dir[160], config[200];
+  snprintf(dir, sizeof(dir), "%s/%s", beachDir, name);
+  snprintf(config, sizeof(config), "%s/config", dir);
+  //a beach still closing keeps its name, its files are in use
+  pthread_mutex_lock(&beaches.mutex);
+  int taken = 0;
+  for (int i = 0; i < beaches.count; i++) taken |= !strcmp(beaches.season[i]->name, name);
+  for (int i = 0; i < beaches.nLoading; i++) taken |= !strcmp(beaches.loading[i], name);
+  if (taken) {
+    pthread_mutex_unlock(&beaches.mutex);
+    return -1;
+  }
+  beaches.loading = realloc(beaches.loading, (beaches.nLoading + 1) * sizeof(char *));
+  beaches.loading[beaches.nLoading++] = strdup(name);
+  pthread_mutex_unlock(&beaches.mutex);
 
-  char buf[100];
-  char *toks[10];
-  int nToks;
-  for (;;) {
-    if ((nToks = readToks(csd, buf, 100, toks, 10)) < 1) break;
-    if (!logged) {
-      if (ckm(toks[0], "login", nToks, 2)) {
-        user = atoi(toks[1]);
-        logged = 1;
-        swrite(csd, "ok");
-      } else swrite(csd, "nlogin");
-    } else {
+  //reading the files takes a while, the other beaches keep taking connections meanwhile
+  Season *season = openSeason(name, dir, config, NULL);
 
-      if (ckm(toks[0], "book", nToks, 1)) {
-        swrite(csd, "ok");
-
-        if ((nToks = readToks(csd, buf, 100, toks, 10)) < 1) break;
-        if (ckm(toks[0], "book", nToks, 2)) {
-          int nUmbrella = atoi(toks[1]);
-          if (lockBooking(season, user, nUmbrella)) { 
-
-            swrite(csd, "available");
-            if ((nToks = readToks(csd, buf, 100, toks, 10)) < 1) break;
-            if (ckm(toks[0], "book", nToks, 3) ||
-                ckm(toks[0], "book", nToks, 4)) {
-              int start, end;
-              if (nToks < 4) {
-                start = getCurrentYday();
-                end = parseDate(toks[2], season->year);
-              } else {
-                start = parseDate(toks[2], season->year);
-                end = parseDate(toks[3], season->year);
-              }
-              if (!addBooking(season, user, nUmbrella, start, end)) { // se data disponibile
-                swrite(csd, "done");
-              } else {
-                swrite(csd, "navailable");
-                unlockBooking(season, nUmbrella);
-              }
-
-            } else if (ckm(toks[0], "cancel", nToks, 1)) {
-              unlockBooking(season, nUmbrella);
-              swrite(csd, "ok");
-
-            } else swrite(csd, "failed");
-          } else swrite(csd, "navailable");
-        } else swrite(csd, "failed");
-
-      } else if (ckm(toks[0], "available", nToks, 3) ||
-                 ckm(toks[0], "available", nToks, 2) ||
-                 ckm(toks[0], "available", nToks, 1)) {
-        int start, end;
-        if (nToks == 1) {
-          start = end = getCurrentYday();
-        } else if (nToks == 2) {
-          start = getCurrentYday();
-          end = parseDate(toks[1], season->year);
-        } else {
-          start = parseDate(toks[1], season->year);
-          end = parseDate(toks[2], season->year);
-        }
-        String umb = {};
-        dcatf(&umb, "available");
-        for (int i = 0; i < season->nUmbrella; i++) {
-          int avail = testBooking(season, user, i, start, end);
-          if (!avail) dcatf(&umb, " %d", i);
-        }
-        if (!strcmp(umb.str, "available")) swrite(csd, "navailable");
-        else swrite(csd, umb.str);
-        free(umb.str);
-
-      } else if (ckm(toks[0], "availrow", nToks, 4) ||
-          ckm(toks[0], "availrow", nToks, 3) ||
-          ckm(toks[0], "availrow", nToks, 2)) {
-        int start, end;
-        if (nToks == 2) {
-          start = end = getCurrentYday();
-        } else if (nToks == 3) {
-          start = getCurrentYday();
-          end = parseDate(toks[2], season->year);
-        } else {
-          start = parseDate(toks[2], season->year);
-          end = parseDate(toks[3], season->year);
-        }
-        int row = atoi(toks[1]);
-        int is = row * season->nCols;
-        int ie = is + season->nCols;
-        String umb = {};
-        if (row < 0 || row >= season->nRows) swrite(csd, "navailable");
-        else {
-          dcatf(&umb, "available");
-          for (int i = is; i < ie; i++) {
-            int avail = testBooking(season, user, i, start, end);
-            if (!avail) dcatf(&umb, " %d", i);
-          }
-          if (!strcmp(umb.str, "available")) swrite(csd, "navailable");
-          else swrite(csd, umb.str);
-        }
-        free(umb.str);
-
-      } else if (ckm(toks[0], "cancel", nToks, 2)) {
-        int nUmbrella = atoi(toks[1]);
-        if (!removeBooking(season, user, nUmbrella)) swrite(csd, "cancel ok");
-        else swrite(csd, "failed");
-      } else if (ckm(toks[0], "logout", nToks, 1)) {
-        swrite(csd, "bye");
-        break;
-      } else if (ckm(toks[0], "save", nToks, 1)) {
-        saveBookingList(season);
-        swrite(csd, "ok");
-      } else if (ckm(toks[0], "today", nToks, 1)) {
-        char dateStr[32];
-        getDateString(dateStr, 32, season->year, getCurrentYday());
-        swrite(csd, dateStr);
-      } else if (ckm(toks[0], "start", nToks, 1)) {
-        char dateStr[32];
-        getDateString(dateStr, 32, season->year, season->start);
-        swrite(csd, dateStr);
-      } else if (ckm(toks[0], "end", nToks, 1)) {
-        char dateStr[32];
-        getDateString(dateStr, 32, season->year, season->end);
-        swrite(csd, dateStr);
-      } else if (ckm(toks[0], "help", nToks, 1)) {
-        swrite(csd, commands);
-      } else swrite(csd, "unknown");
-    }
-  }
-
-  close(csd);
-  removeConnection(conns, conn->id);
-  return NULL;
+  pthread_mutex_lock(&beaches.mutex);
+  for (int i = 0; i < beaches.nLoading; i++) {
+    if (strcmp(beaches.loading[i], name)) continue;
+    free(beaches.loading[i]);
+    beaches.loading[i] = beaches.loading[--beaches.nLoading];
+    break;
+  }
+  if (season) {
+    beaches.season = realloc(beaches.season, (beaches.count + 1) * sizeof(Season *));
+    beaches.season[beaches.count++] = season;
+  }
+  pthread_mutex_unlock(&beaches.mutex);
+  if (season == NULL) return -1;
+  mprintf("Spiaggia %s caricata.\n", name);
+  return 0;
 }
 
-void initConnectionList(ConnectionList *conns) {
+int unloadBeach(const char *name) {
+  Season *season = NULL;
+  pthread_mutex_lock(&beaches.mutex);
+  //the main beach stays, new connections start on it
+  for (int i = 1; i < beaches.count && !season; i++)
+    if (!beaches.season[i]->unloaded && !strcmp(beaches.season[i]->name, name))
+      season = beaches.season[i];
+  if (season) season->unloaded = 1;
+  pthread_mutex_unlock(&beaches.mutex);
+  if (season == NULL) return -1;
+  releaseSeason(season);
+  return 0;
+}
+
+static Connection *connAt(ConnectionList *conns, u32 id) {
+  return conns->chunk[id / CONN_CHUNK] + id % CONN_CHUNK;
+}
+
+static void pushFree(ConnectionList *conns, Connection *conn) {
+  u64 head = __atomic_load_n(&conns->freeHead, __ATOMIC_RELAXED), next;
+  do {
+    conn->nextFree = (int)(u32)head - 1;
+    next = ((head >> 32) + 1) << 32 | (u32)(conn->id + 1);
+  } while (!__atomic_compare_exchange_n(&conns->freeHead, &head, next, 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static Connection *popFree(ConnectionList *conns) {
+  u64 head = __atomic_load_n(&conns->freeHead, __ATOMIC_ACQUIRE), next;
+  Connection *conn;
+  do {
+    if ((u32)head == 0) return NULL;
+    conn = connAt(conns, (u32)head - 1);
+    next = ((head >> 32) + 1) << 32 | (u32)(conn->nextFree + 1);
+  } while (!__atomic_compare_exchange_n(&conns->freeHead, &head, next, 1,
+      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  return conn;
+}
+
+//adds a chunk of free slots, unless another thread just did
+static void growConnections(ConnectionList *conns) {
+  statLock(&conns->mutex, LOCK_CONNS);
+  if ((u32)__atomic_load_n(&conns->freeHead, __ATOMIC_ACQUIRE) == 0) {
+    u32 first = conns->nChunks * CONN_CHUNK;
+    Connection *chunk = calloc(CONN_CHUNK, sizeof(Connection));
+    conns->chunk[conns->nChunks++] = chunk;
+    for (int i = CONN_CHUNK - 1; i >= 0; i--) {
+      chunk[i].id = first + i;
+      chunk[i].list = conns;
+      pushFree(conns, chunk + i);
+    }
+  }
+  pthread_mutex_unlock(&conns->mutex);
+}
+
+void initConnectionList(ConnectionList *conns, u32 max) {
   conns->count = 0;
-  conns->max = MAX_CONN;
+  conns->max = max;
   conns->closed = 0;
-  conns->open = -1;
+  conns->freeHead = 0;
+  conns->nChunks = 0;
+  conns->chunk = calloc((max + CONN_CHUNK - 1) / CONN_CHUNK, sizeof(Connection *));
   pthread_mutex_init(&conns->mutex, 0);
-  Connection *conn = malloc(sizeof(Connection) * MAX_CONN);
-  for (int i = 0; i < MAX_CONN; i++){
-    conn[i].id = i;
-    conn[i].next = i+1;
-  }
-  conn[MAX_CONN-1].next = -1;
-  conns->conn = conn;
 }
 
 Connection *addConnection(ConnectionList *conns, int csd) {
-  Connection *conn = NULL;
-  pthread_mutex_lock(&conns->mutex);
-
-  if (conns->closed != -1) {
-    conn = conns->conn + conns->closed;
-    conns->closed = conn->next;
-    conn->csd = csd;
-    conn->next = conns->open;
-    conn->prev = -1;
-    conns->open = conn->id;
-    if (conn->next != -1) conns->conn[conn->next].prev = conn->id;
-    conns->count++;
+  //a slot is reserved in count first, so the table never grows past max
+  if (__atomic_add_fetch(&conns->count, 1, __ATOMIC_ACQ_REL) > conns->max ||
+      __atomic_load_n(&conns->closed, __ATOMIC_ACQUIRE)) {
+    __atomic_sub_fetch(&conns->count, 1, __ATOMIC_ACQ_REL);
+    return NULL;
   }
-
-  pthread_mutex_unlock(&conns->mutex);
+  Connection *conn;
+  while ((conn = popFree(conns)) == NULL) growConnections(conns);
+  conn->csd = csd;
+  __atomic_store_n(&conn->open, 1, __ATOMIC_RELEASE);
   return conn;
 }
 
 void removeConnection(ConnectionList *conns, int id) {
-  pthread_mutex_lock(&conns->mutex);
-
-  Connection *conn = conns->conn + id;
-  if (conn->next != -1) conns->conn[conn->next].prev = conn->prev;
-  if (conn->prev != -1) conns->conn[conn->prev].next = conn->next;
-  else  conns->open = conn->next;
-  conn->next = conns->closed;
-  conns->closed = conn->id;
-  conns->count--;
-
-  pthread_mutex_unlock(&conns->mutex);
+  Connection *conn = connAt(conns, id);
+  __atomic_store_n(&conn->open, 0, __ATOMIC_RELEASE);
+  pushFree(conns, conn);
+  __atomic_sub_fetch(&conns->count, 1, __ATOMIC_ACQ_REL);
 }
 
-void closeConnections(ConnectionList *conns, Season *season) {
-  pthread_mutex_lock(&conns->mutex);
-  for (int i = 0; i < season->nUmbrella; i++)
-    pthread_mutex_lock(&(season->bookingList[i].mutex));
+u32 openConnections() {
+  u32 count = 0;
+  for (int i = 0; i < server->nListeners; i++)
+    count += __atomic_load_n(&conns[i].count, __ATOMIC_RELAXED);
+  return count;
+}
 
-  //usleep(10000000);
-  int next = conns->open;
-  while (next != -1) {
-    Connection *c = conns->conn + next;
-    close(c->csd);
-    conns->count--;
-    next = c->next;
+void *listenLoop(void *arg) {
+  ConnectionList *conns = (ConnectionList *)arg;
+  for (;;) {
+    int csd = accept(conns->msd, NULL, 0);
+    if (__atomic_load_n(&conns->closed, __ATOMIC_ACQUIRE)) {
+      if (csd != -1) close(csd);
+      break;
+    }
+    if (csd == -1) continue;
+    Connection *conn = addConnection(conns, csd);
+    if (conn == NULL) {
+      swrite(csd, "serverfull");
+      close(csd);
+      continue;
+    }
+    attachConnection(server, conn);
   }
-  conns->closed = -1;
+  return NULL;
+}
 
-  for (int i = 0; i < season->nUmbrella; i++)
-    pthread_mutex_unlock(&(season->bookingList[i].mutex));
+void closeConnections(ConnectionList *conns) {
+  statLock(&conns->mutex, LOCK_CONNS);
+  __atomic_store_n(&conns->closed, 1, __ATOMIC_RELEASE);
+  for (u32 i = 0; i < conns->nChunks * CONN_CHUNK; i++) {
+    Connection *c = connAt(conns, i);
+    if (__atomic_load_n(&c->open, __ATOMIC_ACQUIRE)) close(c->csd);
+  }
   pthread_mutex_unlock(&conns->mutex);
 }
 
 int serverMain(int argc, char **argv) {
-  signal(SIGINT, term);
-  signal(SIGTERM, term);
-  signal(SIGQUIT, term);
-  signal(SIGHUP, term);
-  signal(SIGKILL, term);
+  signal(SIGPIPE, SIG_IGN);
+  if (argc > 1) configfile = argv[1];
+  logStream = fopen(logFile, "w");
+
+  //the helper threads leave the signals to the main thread, which waits for the stop
+  //signals and runs term as plain code, not in a handler racing the other threads
+  sigset_t all, old, stop;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGQUIT);
+  sigaddset(&stop, SIGHUP);
+
+  server = calloc(1, sizeof(Server));
+  server->nReactors = 1;
+  server->maxConn = MAX_CONN;
+  server->port = 12345;
+  server->nListeners = 1;
+  server->maxLag = 5;
+  Season *home = openSeason("main", ".", configfile, server);
+  if (home == NULL) exitError(-1, "invalid config file");
+  startLogger();
+  pthread_t clock;
+  pthread_create(&clock, NULL, clockLoop, NULL);
+  beaches.season = malloc(sizeof(Season *));
+  beaches.season[beaches.count++] = home;
+  //a replica mirrors only the main beach of its primary
+  if (server->beaches && server->primaryPort) exitError(-1, "invalid config file");
+  if (server->beaches) {
+    char *tokstate;
+    for (char *name = strtok_r(server->beaches, ",", &tokstate); name;
+        name = strtok_r(NULL, ",", &tokstate))
+      if (loadBeach(name)) exitError(-1, "invalid beach");
+  }
+
   struct sockaddr_in sa = {0};
   sa.sin_family = AF_INET;
-  sa.sin_port = htons(12345);
+  sa.sin_port = htons(server->port);
   sa.sin_addr.s_addr = INADDR_ANY;
 
-  logStream = fopen(logFile, "w");
-  pthread_mutex_init(&logMutex, NULL);
+  //the kernel spreads the new connections over the listeners bound to the port,
+  //maxconn is split evenly between their shards
+  conns = calloc(server->nListeners, sizeof(ConnectionList));
+  for (int i = 0; i < server->nListeners; i++) {
+    ConnectionList *shard = conns + i;
+    initConnectionList(shard, server->maxConn / server->nListeners +
+        (i < server->maxConn % server->nListeners));
+    CHECK(shard->msd = socket(AF_INET, SOCK_STREAM, 0));
+    int opt = 1;
+    setsockopt(shard->msd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+    //a single listener keeps the port exclusive, a second server fails to bind
+    if (server->nListeners > 1)
+      CHECK(setsockopt(shard->msd, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)));
+    CHECK(bind(shard->msd, (struct sockaddr *)&sa, sizeof(sa)));
+    listen(shard->msd, SOMAXCONN);
+  }
+  initServer(server);
+  for (int i = 0; i < server->nListeners; i++)
+    pthread_create(&conns[i].listener, NULL, listenLoop, conns + i);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
 
-  season = calloc(1, sizeof(Season));
-  loadConfig(season);
-  initBookingList(season);
-  loadBookingList(season);
+  int sig;
+  while (sigwait(&stop, &sig));
+  term(sig);
+  return 0;
+}
 
-  conns = malloc(sizeof(ConnectionList));
-  initConnectionList(conns);
+//load generator: every thread drives its share of the connections from an epoll loop
+enum { OP_LOGIN, OP_AVAILABLE, OP_AVAILROW, OP_BOOK, OP_CANCEL, N_OPS };
+char *opNames[N_OPS] = {"login", "available", "availrow", "book", "cancel"};
 
-  CHECK(conns->msd = socket(AF_INET, SOCK_STREAM, 0));
-  int opt = 1;
-  setsockopt(conns->msd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-  CHECK(bind(conns->msd, (struct sockaddr *)&sa, sizeof(sa)));
-  listen(conns->msd, 100); //buffer 10 requests
+typedef struct BenchConn {
+  int fd;
+  int op;
+  int pending; //replies still expected for op
+  u32 user;
+  u64 sent;
+} BenchConn;
 
-  for (;;) {
-    int csd = accept(conns->msd, NULL, 0);
-    Connection *conn = addConnection(conns, csd);
-    if (conn == NULL) {
-      swrite(csd, "serverfull");
-      close(csd);
+typedef struct BenchThread {
+  BenchConn *conn;
+  int nConn;
+  u32 seed;
+  pthread_t thread;
+  u64 failed;
+  Histogram hist[N_OPS];
+} BenchThread;
+
+struct {
+  struct sockaddr_in sa;
+  int mix[N_OPS]; //weights of the commands
+  int mixTotal;
+  u64 deadline;
+  Season *season;
+} bench;
+
+//sends the next command of the mix
+static void benchSend(BenchThread *thread, BenchConn *c) {
+  Season *season = bench.season;
+  int r = rand_r(&thread->seed) % bench.mixTotal;
+  int op;
+  for (op = OP_AVAILABLE; r >= bench.mix[op]; op++) r -= bench.mix[op];
+
+  int days = season->end - season->start + 1;
+  int start = season->start + rand_r(&thread->seed) % days;
+  int end = start + rand_r(&thread->seed) % 7;
+  if (end > season->end) end = season->end;
+  u32 id = rand_r(&thread->seed) % season->nUmbrella;
+  char from[16], to[16], cmd[128];
+  getDateString(from, sizeof(from), season->year, start);
+  getDateString(to, sizeof(to), season->year, end);
+
+  c->pending = 1;
+  if (op == OP_AVAILABLE) {
+    snprintf(cmd, sizeof(cmd), "available %s %s\n", from, to);
+  } else if (op == OP_AVAILROW) {
+    snprintf(cmd, sizeof(cmd), "availrow %d %s %s\n", id / season->nCols, from, to);
+  } else if (op == OP_BOOK) {
+    //the whole dialogue is pipelined
+    snprintf(cmd, sizeof(cmd), "book\nbook %u\nbook %u %s %s\n", id, id, from, to);
+    c->pending = 3;
+  } else {
+    snprintf(cmd, sizeof(cmd), "cancel %u\n", id);
+  }
+  c->op = op;
+  c->sent = nowUsec();
+  if (write(c->fd, cmd, strlen(cmd)) < 1) c->pending = -1;
+}
+
+void *benchLoop(void *arg) {
+  BenchThread *thread = (BenchThread *)arg;
+  int epfd;
+  CHECK(epfd = epoll_create1(0));
+
+  for (int i = 0; i < thread->nConn; i++) {
+    BenchConn *c = thread->conn + i;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1 || connect(c->fd, (struct sockaddr *)&bench.sa, sizeof(bench.sa))) {
+      thread->failed++;
+      if (c->fd != -1) close(c->fd);
+      c->fd = -1;
       continue;
     }
-    pthread_t child;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_create(&child, &attr, socketListener, conn);
+    //login is timed from the connection, the welcome comes first
+    char cmd[32];
+    snprintf(cmd, sizeof(cmd), "login %u\n", c->user);
+    c->op = OP_LOGIN;
+    c->pending = 2;
+    c->sent = nowUsec();
+    write(c->fd, cmd, strlen(cmd));
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    CHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev));
   }
+
+  struct epoll_event events[MAX_EVENTS];
+  char buf[IN_SIZE];
+  while (nowUsec() < bench.deadline) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; i++) {
+      BenchConn *c = events[i].data.ptr;
+      ssize_t len = read(c->fd, buf, sizeof(buf));
+      if (len < 1 || (c->op == OP_LOGIN && !strncmp(buf, "serverfull", len))) {
+        thread->failed++;
+        //the cleanup below skips it, the number may already belong to another thread
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        continue;
+      }
+      for (ssize_t j = 0; j < len; j++) {
+        if (buf[j] || --c->pending) continue;
+        histRecord(thread->hist + c->op, nowUsec() - c->sent);
+        benchSend(thread, c);
+      }
+    }
+  }
+  for (int i = 0; i < thread->nConn; i++)
+    if (thread->conn[i].fd != -1) close(thread->conn[i].fd);
+  close(epfd);
+  return NULL;
+}
+
+static void benchReport(char *name, Histogram *hist, double seconds) {
+  printf("%-10s %9llu %10.1f %8llu %8llu %8llu %8llu\n", name,
+      (unsigned long long)hist->count, hist->count / seconds,
+      (unsigned long long)histPercentile(hist, 50),
+      (unsigned long long)histPercentile(hist, 99),
+      (unsigned long long)histPercentile(hist, 99.9),
+      (unsigned long long)hist->max);
+}
+
+//times insert and delete of single day bookings on one umbrella holding n of them,
+//up to the full season a list can hold
+static int benchStore() {
+  int sizes[] = {8, 32, 128, 256, 366};
+  int rounds = 200000;
+  Season store = {0};
+  store.nUmbrella = 1;
+  initBookingList(&store);
+  BookingList *list = store.bookingList;
+  u32 seed = 1;
+
+  printf("%-8s %12s (ns per insert and delete)\n", "bookings", "array");
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int n = sizes[s];
+    //n consecutive days are booked, then a random one is released and booked again
+    for (int day = 0; day < n; day++)
+      insertBooking(&store, 0, day + 1, day, day, 0);
+    u64 begin = nowUsec();
+    for (int r = 0; r < rounds; r++) {
+      seed = seed * 1103515245 + 12345;
+      i16 day = (seed >> 8) % n;
+      deleteBooking(&store, 0, day + 1, day);
+      insertBooking(&store, 0, day + 1, day, day, 0);
+    }
+    printf("%-8d %12.1f\n", n, (nowUsec() - begin) * 1000.0 / rounds);
+    freeBookings(&store, list);
+    markDays(&store, 0, 0, SEASON_DAYS - 1, 0);
+  }
+  return 0;
+}
+
+typedef struct LayoutThread {
+  pthread_t thread;
+  Season *season;
+  int id;
+  int scan; //scans the beach instead of booking
+  u64 deadline;
+  u64 ops;
+} LayoutThread;
+
+static void *layoutLoop(void *arg) {
+  LayoutThread *t = arg;
+  Season *season = t->season;
+  u64 avail[BITSET_WORDS(season->nUmbrella)];
+  u32 seed = t->id + 1;
+  while (nowUsec() < t->deadline) {
+    for (int r = 0; r < 64; r++) {
+      if (t->scan) {
+        seed = seed * 1103515245 + 12345;
+        int start = (seed >> 8) % 300;
+        findAvailable(season, start, start + 7, 0, season->nUmbrella, avail);
+        t->ops += season->nUmbrella;
+      } else {
+        //the umbrellas of the threads are next to each other in the first row
+        pthread_mutex_t *mutex = &season->lock[t->id].mutex;
+        pthread_mutex_lock(mutex);
+        insertBooking(season, t->id, t->id + 1, 100, 100, 0);
+        pthread_mutex_unlock(mutex);
+        pthread_mutex_lock(mutex);
+        deleteBooking(season, t->id, t->id + 1, 100);
+        pthread_mutex_unlock(mutex);
+        t->ops += 2;
+      }
+    }
+  }
+  return NULL;
+}
+
+//in process, on a 300x300 beach: threads booking and cancelling neighbouring umbrellas,
+//then threads scanning the whole beach for a week while a third of it is booked
+static int benchLayout(int nThreads, int duration) {
+  Season store = {0};
+  store.nRows = store.nCols = 300;
+  store.nUmbrella = store.nRows * store.nCols;
+  store.start = 0;
+  store.end = 364;
+  initBookingList(&store);
+  LayoutThread *threads = calloc(nThreads, sizeof(LayoutThread));
+
+  printf("%-8s %8s %16s\n", "test", "threads", "per sec");
+  for (int scan = 0; scan < 2; scan++) {
+    if (scan) {
+      u32 seed = 1;
+      for (u32 i = 0; i < store.nUmbrella; i++) {
+        for (int day = 0; day < 365; day += 3) {
+          seed = seed * 1103515245 + 12345;
+          if ((seed >> 8) % 3 == 0) insertBooking(&store, i, 1, day, day + 2, 0);
+        }
+      }
+    }
+    u64 deadline = nowUsec() + duration * 1000000ULL;
+    for (int i = 0; i < nThreads; i++) {
+      threads[i] = (LayoutThread){.season = &store, .id = i, .scan = scan, .deadline = deadline};
+      pthread_create(&threads[i].thread, NULL, layoutLoop, threads + i);
+    }
+    u64 ops = 0;
+    for (int i = 0; i < nThreads; i++) {
+      pthread_join(threads[i].thread, NULL);
+      ops += threads[i].ops;
+    }
+    printf("%-8s %8d %16.0f %s\n", scan ? "scan" : "book", nThreads, ops / (double)duration,
+        scan ? "umbrellas" : "bookings and cancels");
+  }
+  free(threads);
+  return 0;
+}
+
+int benchMain(int argc, char **argv) {
+  int nConn = 1000, nThreads = 4, duration = 10, port = 12345;
+  u32 userBase = 1000;
+  char *host = "127.0.0.1";
+  char *mix = "available=50,availrow=30,book=10,cancel=10";
+  int opt, layout = 0;
+  while ((opt = getopt(argc, argv, "h:p:c:t:d:m:u:sl")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'c': nConn = atoi(optarg); break;
+      case 't': nThreads = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'm': mix = optarg; break;
+      case 'u': userBase = atoi(optarg); break;
+      case 's': return benchStore();
+      case 'l': layout = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-t threads] "
+            "[-d seconds] [-m available=50,availrow=30,book=10,cancel=10] [-u first user] [-s] "
+            "[-l]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (nConn < 1 || nThreads < 1 || duration < 1) {
+    fprintf(stderr, "invalid arguments\n");
+    return 1;
+  }
+  if (layout) return benchLayout(nThreads, duration);
+
+  //the season geometry comes from the same config file as the server
+  logStream = stderr;
+  bench.season = calloc(1, sizeof(Season));
+  Server config = {1, 0, MAX_CONN, 12345, 1};
+  config.maxLag = 5;
+  bench.season->nWorkers = 1;
+  bench.season->leaseTime = LEASE_TIME;
+  if (loadConfig(bench.season, &config, configfile)) exitError(-1, "invalid config file");
+
+  char *mixCopy = strdup(mix), *tokstate;
+  for (char *tok = strtok_r(mixCopy, ",", &tokstate); tok; tok = strtok_r(NULL, ",", &tokstate)) {
+    char *eq = strchr(tok, '=');
+    int op;
+    for (op = OP_AVAILABLE; op < N_OPS; op++)
+      if (eq && !strncmp(tok, opNames[op], eq - tok) && strlen(opNames[op]) == eq - tok) break;
+    if (op == N_OPS) {
+      fprintf(stderr, "invalid mix: %s\n", tok);
+      return 1;
+    }
+    bench.mix[op] = atoi(eq + 1);
+    bench.mixTotal += bench.mix[op];
+  }
+  free(mixCopy);
+  if (bench.mixTotal <= 0) {
+    fprintf(stderr, "invalid mix\n");
+    return 1;
+  }
+
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  signal(SIGPIPE, SIG_IGN);
+
+  bench.sa.sin_family = AF_INET;
+  bench.sa.sin_port = htons(port);
+  bench.sa.sin_addr.s_addr = inet_addr(host);
+
+  BenchThread *threads = calloc(nThreads, sizeof(BenchThread));
+  BenchConn *conns = calloc(nConn, sizeof(BenchConn));
+  u64 begin = nowUsec();
+  bench.deadline = begin + duration * 1000000ULL;
+  for (int i = 0; i < nThreads; i++) {
+    BenchThread *thread = threads + i;
+    int first = (long)nConn * i / nThreads;
+    thread->conn = conns + first;
+    thread->nConn = (long)nConn * (i + 1) / nThreads - first;
+    thread->seed = begin + i;
+    for (int j = 0; j < thread->nConn; j++) thread->conn[j].user = userBase + first + j;
+    pthread_create(&thread->thread, NULL, benchLoop, thread);
+  }
+
+  Histogram total[N_OPS] = {{0}}, all = {0};
+  u64 failed = 0;
+  for (int i = 0; i < nThreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    failed += threads[i].failed;
+    for (int op = 0; op < N_OPS; op++) histMerge(total + op, threads[i].hist + op);
+  }
+  double seconds = (nowUsec() - begin) / 1e6;
+
+  printf("connections %d (%llu failed or refused), %d threads, %.1f s\n",
+      nConn, (unsigned long long)failed, nThreads, seconds);
+  printf("%-10s %9s %10s %8s %8s %8s %8s (us)\n",
+      "command", "count", "per sec", "p50", "p99", "p999", "max");
+  for (int op = 0; op < N_OPS; op++) {
+    if (!total[op].count) continue;
+    benchReport(opNames[op], total + op, seconds);
+    if (op != OP_LOGIN) histMerge(&all, total + op);
+  }
+  benchReport("all", &all, seconds);
   return 0;
 }
 
 int clientMain(int argc, char **argv) {
   struct sockaddr_in sa = {0};
   sa.sin_family = AF_INET;
-  sa.sin_port = htons(12345);
+  sa.sin_port = htons(argc > 1 ? atoi(argv[1]) : 12345);
   sa.sin_addr.s_addr = inet_addr("127.0.0.1");
 
   int sd;
@@ -755,10 +4854,13 @@ int clientMain(int argc, char **argv) {
   char *line = NULL;
   size_t size = 0;
   int len = 0;
+  int n;
   while(1) {
-    memset(buffer, 0, 1000);
-    if (read(sd, buffer, 1000) < 1) break;
-    printf("%s\n", buffer);
+    if ((n = read(sd, buffer, 999)) < 1) break;
+    buffer[n] = 0;
+    //the replies to pipelined commands arrive one after the other
+    for (char *reply = buffer; reply < buffer + n; reply += strlen(reply) + 1)
+      printf("%s\n", reply);
     if ((len = getline(&line, &size, stdin)) == -1) continue;
     write(sd, line, len);
   }
@@ -766,3 +4868,302 @@ int clientMain(int argc, char **argv) {
   free(line);
   return 0;
 }
+
+//beachctl: bulk loads the bookings of a beach from csv, offline on its files or online through
+//the bulk command of the server, and exports them without stopping the server
+
+//the season of a beach with its config, no threads and no lists yet
+static Season *ctlSeason(const char *name, char *config, size_t len) {
+  Season *season = calloc(1, sizeof(Season));
+  snprintf(season->name, sizeof(season->name), "%s", name);
+  if (!strcmp(name, "main")) {
+    snprintf(season->dir, sizeof(season->dir), ".");
+    snprintf(config, len, "%s", configfile);
+  } else {
+    snprintf(season->dir, sizeof(season->dir), "%s/%s", beachDir, name);
+    snprintf(config, len, "%s/config", season->dir);
+  }
+  seasonPath(season, season->wal.base, sizeof(season->wal.base), walfile);
+  Server server = {1, 0, MAX_CONN, 12345, 1};
+  server.maxLag = 5;
+  season->nWorkers = 1;
+  if (loadConfig(season, &server, config)) {
+    fprintf(stderr, "invalid config file %s\n", config);
+    free(season);
+    return NULL;
+  }
+  return season;
+}
+
+//next row of a csv of umbrella,user,start,end, skipping blank lines, comments and the header;
+//returns the number of fields, only the first five are kept, or -1 at the end of the file
+static int readCsvRow(FILE *fp, char **line, size_t *size, u32 *lineNo, char **toks) {
+  while (getline(line, size, fp) != -1) {
+    ++*lineNo;
+    int n = 0;
+    char *state;
+    for (char *tok = strtok_r(*line, ", \t\r\n", &state); tok; tok = strtok_r(NULL, ", \t\r\n", &state)) {
+      if (n < 5) toks[n] = tok;
+      n++;
+    }
+    if (n == 0 || toks[0][0] == '#' || isalpha((unsigned char)toks[0][0])) continue;
+    return n;
+  }
+  return -1;
+}
+
+static void importBatch(Season *season, BulkRow *rows, int n, u32 *count) {
+  bulkBookings(season, rows, n);
+  for (int i = 0; i < n; i++) {
+    count[rows[i].status]++;
+    if (rows[i].status == BULK_REJECTED)
+      fprintf(stderr, "line %u: overlaps another booking\n", rows[i].line);
+  }
+  walCommit(&season->wal);
+}
+
+//books the rows on the files of the beach, which no server may have open
+static int ctlImport(const char *name, const char *path) {
+  FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (fp == NULL) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+  char config[200];
+  Season *season = ctlSeason(name, config, sizeof(config));
+  if (season == NULL) return 1;
+  if (lockSeason(season, config)) {
+    fprintf(stderr, "beach %s is open in a server, use load\n", name);
+    free(season);
+    return 1;
+  }
+  initBookingList(season);
+  loadBookingList(season);
+
+  BulkRow *rows = malloc(BULK_BATCH * sizeof(BulkRow));
+  char *line = NULL, *toks[5];
+  size_t size = 0;
+  u32 lineNo = 0, count[3] = {0};
+  int n = 0, nToks;
+  while ((nToks = readCsvRow(fp, &line, &size, &lineNo, toks)) != -1) {
+    rows[n].line = lineNo;
+    if (parseBulkRow(season, toks, nToks, rows + n)) {
+      fprintf(stderr, "line %u: invalid row\n", lineNo);
+      count[BULK_REJECTED]++;
+    } else if (++n == BULK_BATCH) {
+      importBatch(season, rows, n, count);
+      n = 0;
+    }
+  }
+  importBatch(season, rows, n, count);
+  if (fp != stdin) fclose(fp);
+  free(line);
+  free(rows);
+
+  //the server starts from the snapshot, with no log to replay
+  saveBookingList(season);
+  stopWal(&season->wal);
+  close(season->lockFd);
+  freeSeason(season);
+  printf("added %u present %u rejected %u\n",
+      count[BULK_ADDED], count[BULK_PRESENT], count[BULK_REJECTED]);
+  return count[BULK_REJECTED] ? 2 : 0;
+}
+
+//reads a reply of the server, each one ends with a NUL
+static int ctlReply(int sd, char *buf, int size) {
+  int len = 0;
+  do {
+    int n = read(sd, buf + len, size - 1 - len);
+    if (n < 1) return -1;
+    len += n;
+  } while (buf[len - 1] && len < size - 1);
+  buf[len] = 0;
+  return 0;
+}
+
+//sends a command expecting ok as the reply
+static int ctlCommand(int sd, char *buf, int size, const char *command) {
+  if (write(sd, command, strlen(command)) != strlen(command) || ctlReply(sd, buf, size)) {
+    fprintf(stderr, "connection closed by the server\n");
+    return -1;
+  }
+  if (strcmp(buf, "ok")) {
+    fprintf(stderr, "%.*s: %s\n", (int)strlen(command) - 1, command, buf);
+    return -1;
+  }
+  return 0;
+}
+
+//streams the rows to the bulk command of a running server
+static int ctlLoad(const char *name, const char *path, int port) {
+  FILE *in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (in == NULL) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+  struct sockaddr_in sa = {0};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  int sd;
+  CHECK(sd = socket(AF_INET, SOCK_STREAM, 0));
+  if (connect(sd, (struct sockaddr *)&sa, sizeof(sa))) {
+    fprintf(stderr, "no server on port %d\n", port);
+    return 1;
+  }
+
+  char buf[4096], use[64];
+  snprintf(use, sizeof(use), "use %s\n", name);
+  //the session user is not the one of the bookings, any id does
+  if (ctlReply(sd, buf, sizeof(buf)) || strcmp(buf, "welcome")) {
+    fprintf(stderr, "server busy\n");
+    return 1;
+  }
+  if (ctlCommand(sd, buf, sizeof(buf), "login 0\n") ||
+      (strcmp(name, "main") && ctlCommand(sd, buf, sizeof(buf), use)) ||
+      ctlCommand(sd, buf, sizeof(buf), "bulk\n"))
+    return 1;
+
+  //the server numbers the rows it gets, the file lines they came from are kept to report them
+  FILE *out = fdopen(dup(sd), "w");
+  char *line = NULL, *toks[5];
+  size_t size = 0;
+  u32 lineNo = 0, nRows = 0, *lines = NULL;
+  int nToks;
+  while ((nToks = readCsvRow(in, &line, &size, &lineNo, toks)) != -1) {
+    if ((nRows & (nRows - 1)) == 0) lines = realloc(lines, (nRows ? 2 * nRows : 1) * sizeof(u32));
+    lines[nRows++] = lineNo;
+    for (int i = 0; i < nToks && i < 5; i++) fprintf(out, i ? " %s" : "%s", toks[i]);
+    fprintf(out, "\n");
+  }
+  fprintf(out, "commit\n");
+  if (fclose(out) || ctlReply(sd, buf, sizeof(buf))) {
+    fprintf(stderr, "connection closed by the server\n");
+    return 1;
+  }
+  if (in != stdin) fclose(in);
+  free(line);
+
+  u32 added, present, rejected;
+  if (sscanf(buf, "bulk added %u present %u rejected %u", &added, &present, &rejected) != 3) {
+    fprintf(stderr, "bulk: %s\n", buf);
+    return 1;
+  }
+  char *report = strchr(buf, '\n');
+  if (report) {
+    char *tok, *state;
+    strtok_r(report, " \n", &state);
+    while ((tok = strtok_r(NULL, " \n", &state))) {
+      u32 row = atoi(tok);
+      if (row >= 1 && row <= nRows) fprintf(stderr, "line %u: rejected\n", lines[row - 1]);
+    }
+    if (rejected > BULK_REPORT) fprintf(stderr, "only the first %d rejected lines reported\n", BULK_REPORT);
+  }
+  free(lines);
+  write(sd, "logout\n", 7);
+  close(sd);
+  printf("added %u present %u rejected %u\n", added, present, rejected);
+  return rejected ? 2 : 0;
+}
+
+//identity of a file, a checkpoint of the server replaces or extends it
+static void fileStamp(Season *season, const char *file, struct stat *st) {
+  char path[256];
+  seasonPath(season, path, sizeof(path), file);
+  if (stat(path, st)) memset(st, 0, sizeof(*st));
+}
+
+static int sameStamp(struct stat *a, struct stat *b) {
+  return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+      a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+//reads the files like a restart would; the log grows only at its end, so the read is
+//consistent unless a checkpoint moved the files meanwhile, and then it starts again
+static int ctlExport(const char *name, const char *path) {
+  const char *files[] = {snapfile, deltafile, savefile};
+  struct stat before[3], after[3];
+  Season *season;
+  u64 lastLsn;
+  for (int attempt = 0; ; attempt++) {
+    char config[200];
+    if ((season = ctlSeason(name, config, sizeof(config))) == NULL) return 1;
+    for (int i = 0; i < 3; i++) fileStamp(season, files[i], before + i);
+    u32 walSeq = 1;
+    lastLsn = 0;
+    initBookingList(season);
+    readBookingList(season, &walSeq, &lastLsn);
+    int same = 1;
+    for (int i = 0; i < 3; i++) {
+      fileStamp(season, files[i], after + i);
+      same = same && sameStamp(before + i, after + i);
+    }
+    if (same) break;
+    freeSeason(season);
+    if (attempt == 10) {
+      fprintf(stderr, "beach %s keeps changing, try again\n", name);
+      return 1;
+    }
+  }
+
+  FILE *fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+  if (fp == NULL) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+  fprintf(fp, "umbrella,user,start,end\n");
+  Booking *copy = NULL;
+  u32 copySize = 0;
+  u64 count = 0;
+  for (u32 i = 0; i < season->nUmbrella; i++) {
+    BookingList *list = season->bookingList + i;
+    if (copySize < list->count) {
+      copySize = list->count;
+      copy = realloc(copy, copySize * sizeof(Booking));
+    }
+    copyBookings(list, copy);
+    for (u32 j = 0; j < list->count; j++) {
+      char start[32], end[32];
+      getDateString(start, sizeof(start), season->year, copy[j].start);
+      getDateString(end, sizeof(end), season->year, copy[j].end);
+      fprintf(fp, "%u,%u,%s,%s\n", i, copy[j].user, start, end);
+    }
+    count += list->count;
+  }
+  free(copy);
+  freeSeason(season);
+  if (fclose(fp)) {
+    fprintf(stderr, "cannot write %s\n", path);
+    return 1;
+  }
+  fprintf(stderr, "exported %llu bookings up to record %llu\n",
+      (unsigned long long)count, (unsigned long long)lastLsn);
+  return 0;
+}
+
+int ctlMain(int argc, char **argv) {
+  int port = 12345, opt;
+  char *name = "main";
+  while ((opt = getopt(argc, argv, "p:b:")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 'b': name = optarg; break;
+      default: optind = argc; break;
+    }
+  }
+  logStream = stderr;
+  signal(SIGPIPE, SIG_IGN);
+  if (optind + 2 == argc) {
+    char *command = argv[optind], *path = argv[optind + 1];
+    if (!strcmp(command, "import")) return ctlImport(name, path);
+    if (!strcmp(command, "load")) return ctlLoad(name, path, port);
+    if (!strcmp(command, "export")) return ctlExport(name, path);
+  }
+  fprintf(stderr, "usage: %s [-p port] [-b beach] import|load|export file\n"
+      "  import  books the rows of the csv on the files of a beach no server has open\n"
+      "  load    books them through the server listening on port\n"
+      "  export  writes the bookings as csv, also while the server runs\n"
+      "rows are umbrella,user,start,end with dd/mm/yyyy dates, - is stdin or stdout\n", argv[0]);
+  return 1;
+}
@@ -1,7 +1,38 @@
 import pexpect
+import signal
+import socket
+import time
 
-pexpect.run("rm data")
-server = pexpect.spawn("./server")
+#raw connection for the commands with no reply of their own and for pipelining
+def connect():
+  for i in range(0,50):
+    try:
+      s = socket.create_connection(("127.0.0.1", 12345))
+      s.settimeout(5)
+      return s
+    except socket.error:
+      time.sleep(0.1)
+  raise Exception("no server")
+
+#returns the next n replies, each one ends with a NUL
+def replies(s, n):
+  data = b""
+  while data.count(b"\0") < n:
+    data += s.recv(65536)
+  return data.split(b"\0")[:n]
+
+def session(user):
+  s = connect()
+  assert replies(s, 1) == [b"welcome"]
+  s.sendall(b"login " + str(user).encode() + b"\n")
+  assert replies(s, 1) == [b"ok"]
+  return s
+
+pexpect.run("sh -c 'rm -f data snapshot snapshot.delta wal.*'")
+#the dates below are relative to a fixed day of the season, the leases are short
+cfg = open("config").read() + "today = 01/07/2017\nlease = 3\n"
+open("test.config", "w").write(cfg)
+server = pexpect.spawn("./server test.config")
 
 clients = list();
 
@@ -55,5 +86,103 @@ for i in range(0,10):
 
 print "test booking 2"
 
+#the connections are all taken, the others make room for the raw ones
+for i in range(3,10):
+  clients[i].terminate(True)
+time.sleep(0.5)
+
+s = session(20)
+s.sendall(b"book\nbook 15\nbook 15 01/09/2017 03/09/2017\navailable 01/09/2017 03/09/2017\n")
+assert replies(s, 4) == [b"ok", b"available", b"done",
+    b"available 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14"]
+
+print "tested pipelined commands"
+
+#15 is taken, so 12 must stay free as well
+s.sendall(b"bookgroup 13,14 01/09/2017 02/09/2017\nbookgroup 12,15 01/09/2017 02/09/2017\n"
+    b"availrow 3 01/09/2017 01/09/2017\n")
+assert replies(s, 3) == [b"done", b"navailable", b"available 12"]
+
+print "tested group booking"
+
+s.sendall(b"mybookings\ncancel all\nmybookings\navailrow 3 01/09/2017 01/09/2017\n")
+assert replies(s, 4) == [
+    b"mybookings\n13 01/09/2017 02/09/2017\n14 01/09/2017 02/09/2017\n15 01/09/2017 03/09/2017",
+    b"cancel ok", b"mybookings", b"available 12 13 14 15"]
+s.close()
+
+print "tested cancel all"
+
+a = session(21)
+b = session(22)
+a.sendall(b"book\nbook 5 01/06/2017 05/06/2017\n")
+assert replies(a, 2) == [b"ok", b"available"]
+b.sendall(b"book\nbook 5 04/06/2017 06/06/2017\n")
+assert replies(b, 2) == [b"ok", b"navailable"]
+b.sendall(b"book\nbook 5 10/06/2017 12/06/2017\nbook 5 10/06/2017 12/06/2017\n")
+assert replies(b, 3) == [b"ok", b"available", b"done"]
+a.sendall(b"book 5 01/06/2017 05/06/2017\n")
+assert replies(a, 1) == [b"done"]
+
+#with no dates the lease holds the whole season until it expires
+a.sendall(b"book\nbook 6\n")
+assert replies(a, 2) == [b"ok", b"available"]
+b.sendall(b"book\nbook 6 01/06/2017 01/06/2017\n")
+assert replies(b, 2) == [b"ok", b"navailable"]
+time.sleep(4)
+b.sendall(b"book\nbook 6 01/06/2017 01/06/2017\nbook 6 01/06/2017 01/06/2017\n")
+assert replies(b, 3) == [b"ok", b"available", b"done"]
+a.close()
+b.close()
+
+print "tested leases"
+
+#row 2 is already there, row 3 overlaps row 1 and umbrella 99 does not exist
+rows = (b"0 30 01/05/2017 02/05/2017\n0 30 01/05/2017 02/05/2017\n0 31 02/05/2017 03/05/2017\n"
+    b"99 30 01/05/2017 01/05/2017\n1 30 03/05/2017 04/05/2017\n")
+s = session(20)
+s.sendall(b"bulk\n" + rows + b"commit\n")
+assert replies(s, 2) == [b"ok", b"bulk added 2 present 1 rejected 2\nrejected 4 3"]
+s.sendall(b"bulk\n" + rows + b"commit\n")
+assert replies(s, 2) == [b"ok", b"bulk added 0 present 3 rejected 2\nrejected 4 3"]
+s.close()
+
+print "tested bulk"
+
+#nothing was saved, the bookings come back from the log
+for c in clients[0:3]:
+  c.close()
+server.kill(signal.SIGKILL)
+server.wait()
+server = pexpect.spawn("./server test.config")
+s = session(30)
+s.sendall(b"mybookings\n")
+assert replies(s, 1) == [b"mybookings\n0 01/05/2017 02/05/2017\n1 03/05/2017 04/05/2017"]
+s.sendall(b"available 02/07/2017 02/07/2017\n")
+assert replies(s, 1) == [b"available 10 11 12 13 14 15"]
+s.sendall(b"available 05/08/2017 05/08/2017\n")
+assert replies(s, 1) == [b"available 0 1 2 3 4 5 6 7 8 9 11 12 13 14 15"]
+for cmd, reply in [(b"save", b"ok"), (b"book", b"ok"), (b"book 7", b"available"),
+    (b"book 7 20/09/2017 20/09/2017", b"done")]:
+  s.sendall(cmd + b"\n")
+  assert replies(s, 1) == [reply]
+s.close()
+
+#then from the snapshot and the log written after it
+server.kill(signal.SIGKILL)
+server.wait()
+server = pexpect.spawn("./server test.config")
+s = session(30)
+s.sendall(b"mybookings\n")
+assert replies(s, 1) == [b"mybookings\n0 01/05/2017 02/05/2017\n1 03/05/2017 04/05/2017\n"
+    b"7 20/09/2017 20/09/2017"]
+s.sendall(b"available 02/07/2017 02/07/2017\n")
+assert replies(s, 1) == [b"available 10 11 12 13 14 15"]
+s.sendall(b"available 20/09/2017 20/09/2017\n")
+assert replies(s, 1) == [b"available 0 1 2 3 4 5 6 8 9 10 11 12 13 14 15"]
+s.close()
+
+print "tested log replay"
+
 server.terminate(True)
 print "fine"